@@ -16,8 +16,10 @@
 
 #include <libkern/c++/OSObject.h>
 #include <libkern/libkern.h>
+#include <kern/thread_call.h>
 
 #include "USBDeviceController.hpp"
+#include "RtlCore.h"
 #include "Hci.h"
 
 typedef struct __attribute__((packed)) {
@@ -119,29 +121,7 @@ typedef struct __attribute__((packed))
     uint8_t     len;
 } FWCommandHdr;
 
-#define HCI_OP_READ_LOCAL_VERSION 0x1001
-#define HCI_OP_RTL_READ_ROM_VERSION 0xfc6d
-#define HCI_OP_RTL_DOWNLOAD_FW 0xfc20
-#define HCI_OP_RTL_READ_REG 0xfc61
-#define HCI_OP_RTL_COREDUMP 0xfcff
-
-#define RTL_FRAG_LEN 252
-
-// These structs are from linux/drivers/bluetooth/btrtl.h
-struct rtl_rom_version_evt {
-	__u8 status;
-	__u8 version;
-} __packed;
-
-struct rtl_download_cmd {
-	__u8 index;
-	__u8 data[RTL_FRAG_LEN];
-} __packed;
-
-struct rtl_download_response {
-	__u8 status;
-	__u8 index;
-} __packed;
+struct FwDevice;
 
 #define BDADDR_RTL        (&(bdaddr_t){{0x00, 0x8b, 0x9e, 0x19, 0x03, 0x00}}) // FIXME: This needs to be changed to Realtek specific
 #define RSA_HEADER_LEN        644
@@ -149,33 +129,11 @@ struct rtl_download_response {
 #define ECDSA_OFFSET        644
 #define ECDSA_HEADER_LEN    320
 
-#define CMD_BUF_MAX_SIZE    256
-
-#define RTL_EPATCH_SIGNATURE "Realtech"
-#define RTL_EPATCH_SIGNATURE_V2 "RTBTCore"
-
-struct rtl_epatch_header {
-	__u8 signature[8];
-	__le32 fw_version;
-	__le16 num_patches;
-} __packed;
-
-struct rtl_epatch_header_v2 {
-	__u8   signature[8];
-	__u8   fw_version[8];
-	__le32 num_sections;
-} __packed;
-
-struct rtl_section {
-	__le32 opcode;
-	__le32 len;
-	u8     data[];
-} __packed;
-
 class BtRtl : public OSObject {
     OSDeclareAbstractStructors(BtRtl)
 public:
     
+    /* Opens the USB pipes only; call setupFirmware() to bring the controller up. */
     virtual bool initWithDevice(IOService *client, IOUSBHostDevice *dev);
     
     virtual void free() override;
@@ -220,13 +178,29 @@ public:
     
     OSData *requestFirmwareData(const char *fwName, bool noWarn = false);
     
-    OSData *parseFirmware(OSData *firmware, uint8_t rom_version, int project_id);
-    
-    bool downloadFirmware(OSData *firmwarePatch);
     bool setupFirmware();
+    
+    /* Snapshot of the HCI latency statistics for the IORegistry. */
+    OSDictionary *copyHciStats();
+    
+    /*
+     * HCI capture, enabled with the rtlsnoop=<KiB> boot-arg. The btsnoop
+     * file, up to that size, is kept privately and a copy of it published
+     * as the HCICapture property of the client on every flush; flushes run
+     * on a thread call, never on the I/O path.
+     */
+    bool startCapture(uint32_t capacity);
+    
+    void flushCapture();
 
 private:
     static OSData *loadFirmwareFromFile(const char *fileName);
+    
+    static void captureFlushRequested(void *context);
+    
+    static void captureFlush(thread_call_param_t param0, thread_call_param_t param1);
+    
+    static void captureSink(void *context, const uint8_t *data, uint32_t len);
 
 protected:
     
@@ -238,6 +212,11 @@ protected:
     
 protected:
     USBDeviceController *m_pUSBDeviceController;
+    RtlCore *m_pCore;
+    const FwDevice *m_pDevice;
+    IOService *m_pClient;
+    thread_call_t m_captureCall;
+    OSData *m_pCaptureData;
 };
 
 #endif /* BtRtl_h */
@@ -13,89 +13,175 @@
 
 #ifndef FwData_h
 #define FwData_h
-#include <string.h>
-#include <libkern/c++/OSData.h>
+#include "RtlPlatform.h"
+#include "RtlChipId.h"
+#ifdef KERNEL
 #include <libkern/zlib.h>
 #include <zutil.h>
+#define RTL_ZALLOC zcalloc
+#define RTL_ZFREE zcfree
+#else
+#include <zlib.h>
+#define RTL_ZALLOC Z_NULL
+#define RTL_ZFREE Z_NULL
+#endif
+
+/* How an embedded blob is stored; generate_fw_data.py picks one per blob. */
+enum FwCodec {
+    FW_CODEC_NONE = 0,
+    FW_CODEC_ZLIB = 1,
+    FW_CODEC_LZ4 = 2,   // LZ4 block, decoded in one pass (RtlLz4.h)
+};
 
 struct FwDesc {
     const char *name;
     const unsigned char *var;
     const long int size; // Kích thước của dữ liệu đã nén
-    const bool compressed;
+    const uint8_t codec; // FwCodec
     const long int uncompressed_size; // Kích thước của dữ liệu gốc
+    const uint32_t crc32c; // CRC32C của dữ liệu gốc, kiểm tra khi giải nén
+    const uint32_t stored_crc32c; // CRC32C của size byte trong var, kiểm tra trước khi gửi
+    const struct FwDesc *dict; // Blob gốc dùng làm từ điển, NULL nếu không có
 };
 
-#define IBT_FW(fw_name, fw_var, fw_size, fw_compressed, fw_uncompressed_size) \
-    .name = fw_name, .var = fw_var, .size = fw_size, .compressed = fw_compressed, .uncompressed_size = fw_uncompressed_size
+#define IBT_FW(fw_name, fw_var, fw_size, fw_codec, fw_uncompressed_size, fw_crc32c, fw_stored_crc32c, fw_dict) \
+    .name = fw_name, .var = fw_var, .size = fw_size, .codec = fw_codec, .uncompressed_size = fw_uncompressed_size, \
+    .crc32c = fw_crc32c, .stored_crc32c = fw_stored_crc32c, .dict = fw_dict
+
 
+/*
+ * Patch of one (firmware, rom_version) pair, extracted from its epatch
+ * image at build time. patch holds exactly the bytes that are downloaded,
+ * fw_version already in place and the chip config, if any, appended, so
+ * it goes out as one record; name is the image it came from.
+ */
+struct FwPatchIndex {
+    uint16_t lmp_subversion;
+    uint8_t rom_version;
+    uint8_t project_id;
+    uint32_t fw_version;
+    uint32_t config_size; // Số byte config ở cuối patch, 0 nếu không có
+    struct FwDesc patch; // patch.var là NULL ở ô trống
+};
+
+/* What the driver knows about a chip before talking to it, from RtlChipId.h. */
+struct FwChip {
+    const char *name;
+    uint16_t lmp_subversion;
+    const char *firmware;
+    const char *config; // NULL nếu chip không cần config
+    uint32_t quirks;
+    uint32_t rom_versions; // bit n: có patch cho ROM version n
+};
+
+struct FwDevice {
+    uint16_t vendor;
+    uint16_t product;
+    const struct FwChip *chip;
+};
 
 extern const struct FwDesc fwList[];
 extern const int fwNumber;
 
-// Khai báo trước hàm uncompressFirmware để getFWDescByName có thể sử dụng
-static inline bool uncompressFirmware(unsigned char *dest, uint *destLen, unsigned char *source, uint sourceLen);
-
-static inline OSData *getFWDescByName(const char* name) {
-    for (int i = 0; i < fwNumber; i++) {
-        if (strcmp(fwList[i].name, name) == 0) {
-            FwDesc desc = fwList[i];
-            
-            if (desc.compressed) {
-                // Nếu firmware được nén, hãy giải nén nó
-                uint destLen = (uint)desc.uncompressed_size;
-                // Cấp phát bộ đệm cho dữ liệu đã giải nén
-                unsigned char* uncompressed_data = (unsigned char*)IOMalloc(destLen);
-                if (!uncompressed_data) {
-                    // Xử lý lỗi không cấp phát được bộ nhớ
-                    return NULL;
-                }
-                
-                // Gọi hàm giải nén
-                if (uncompressFirmware(uncompressed_data, &destLen, (unsigned char*)desc.var, (uint)desc.size)) {
-                    // Tạo đối tượng OSData từ dữ liệu đã giải nén
-                    OSData* data = OSData::withBytes(uncompressed_data, destLen);
-                    // Giải phóng bộ đệm đã cấp phát
-                    IOFree(uncompressed_data, desc.uncompressed_size);
-                    return data;
-                } else {
-                    // Xử lý lỗi giải nén
-                    IOFree(uncompressed_data, desc.uncompressed_size);
-                    return NULL;
-                }
-            } else {
-                // Nếu không được nén, trả về trực tiếp
-                return OSData::withBytes(desc.var, (unsigned int)desc.size);
-            }
+extern const int16_t fwNameIndex[];
+extern const uint32_t fwNameIndexSeed;
+extern const uint32_t fwNameIndexMask;
+
+extern const struct FwPatchIndex fwPatchIndex[];
+extern const uint32_t fwPatchIndexSeed;
+extern const uint32_t fwPatchIndexMask;
+
+/* Slot in fwPatchIndex of each v1 patch, hashed on (fw_version, rom_version). */
+extern const int16_t fwPatchVersionIndex[];
+extern const uint32_t fwPatchVersionIndexSeed;
+extern const uint32_t fwPatchVersionIndexMask;
+
+extern const struct FwChip fwChipList[];
+extern const int fwChipNumber;
+
+/* Sorted by (vendor, product). */
+extern const struct FwDevice fwDeviceList[];
+extern const int fwDeviceNumber;
+
+/* FNV-1a over a file name; generate_fw_data.py mirrors these hashes. */
+static constexpr uint32_t fwNameHash(const char *name, uint32_t h = 2166136261u)
+{
+    return *name ? fwNameHash(name + 1, (h ^ (uint8_t)*name) * 16777619u) : h;
+}
+
+static constexpr uint32_t fwPatchKey(const char *firmware, uint8_t rom_version)
+{
+    return fwNameHash(firmware) ^ rom_version;
+}
+
+static constexpr uint32_t fwPatchVersionKey(uint32_t fw_version, uint8_t rom_version)
+{
+    return fw_version * 16777619u ^ rom_version;
+}
+
+static constexpr uint32_t fwKeyMix(uint32_t h)
+{
+    return h ^ (h >> 16);
+}
+
+static constexpr uint32_t fwKeyMix13(uint32_t h)
+{
+    return (h ^ (h >> 13)) * 0xc2b2ae35u;
+}
+
+/* murmur3 finalizer over key ^ seed, this is what the seeds select on. */
+static constexpr uint32_t fwKeyHash(uint32_t key, uint32_t seed)
+{
+    return fwKeyMix(fwKeyMix13(fwKeyMix(key ^ seed) * 0x85ebca6bu));
+}
+
+static inline const FwDesc *findFWDesc(const char *name)
+{
+    int16_t i = fwNameIndex[fwKeyHash(fwNameHash(name), fwNameIndexSeed) & fwNameIndexMask];
+    return (i >= 0 && strcmp(fwList[i].name, name) == 0) ? &fwList[i] : NULL;
+}
+
+static inline const FwPatchIndex *findFWPatch(const char *firmware, uint8_t rom_version)
+{
+    const FwPatchIndex *entry = &fwPatchIndex[fwKeyHash(fwPatchKey(firmware, rom_version), fwPatchIndexSeed) & fwPatchIndexMask];
+    if (!entry->patch.var || entry->rom_version != rom_version || strcmp(entry->patch.name, firmware) != 0) {
+        return NULL;
+    }
+    return entry;
+}
+
+static inline const FwDevice *findFWDevice(uint16_t vendor, uint16_t product)
+{
+    uint32_t key = ((uint32_t)vendor << 16) | product;
+    int lo = 0, hi = fwDeviceNumber;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        uint32_t midKey = ((uint32_t)fwDeviceList[mid].vendor << 16) | fwDeviceList[mid].product;
+        if (midKey == key) {
+            return &fwDeviceList[mid];
+        }
+        if (midKey < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
     }
     return NULL;
 }
 
-static inline bool uncompressFirmware(unsigned char *dest, uint *destLen, unsigned char *source, uint sourceLen)
+/*
+ * Find the patch a controller is already running. Once patched, its local
+ * version reports hci_rev << 16 | lmp_subver equal to the v1 fw_version of
+ * the patch; v2 entries carry no fw_version and are not in the index.
+ */
+static inline const FwPatchIndex *findFWPatchByVersion(uint32_t fw_version, uint8_t rom_version)
 {
-    z_stream stream;
-    int err;
-    
-    stream.next_in = source;
-    stream.avail_in = sourceLen;
-    stream.next_out = dest;
-    stream.avail_out = *destLen;
-    stream.zalloc = zcalloc;
-    stream.zfree = zcfree;
-    err = inflateInit(&stream);
-    if (err != Z_OK) {
-        return false;
+    int16_t i = fwPatchVersionIndex[fwKeyHash(fwPatchVersionKey(fw_version, rom_version), fwPatchVersionIndexSeed) & fwPatchVersionIndexMask];
+    if (fw_version == 0 || i < 0 || fwPatchIndex[i].fw_version != fw_version || fwPatchIndex[i].rom_version != rom_version) {
+        return NULL;
     }
-    err = inflate(&stream, Z_FINISH);
-    if (err != Z_STREAM_END) {
-        inflateEnd(&stream);
-        return false;
-    }
-    *destLen = (uint)stream.total_out;
-
-    err = inflateEnd(&stream);
-    return err == Z_OK;
+    return &fwPatchIndex[i];
 }
 
 #endif /* FwData_h */
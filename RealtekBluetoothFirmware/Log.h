@@ -14,7 +14,7 @@
 #ifndef Log_h
 #define Log_h
 
-#include <IOKit/IOLib.h>
+#include "RtlPlatform.h"
 
 #define XYLog(fmt, x...)\
 do\
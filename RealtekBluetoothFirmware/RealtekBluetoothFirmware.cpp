@@ -1,5 +1,9 @@
 #include "RealtekBluetoothFirmware.hpp"
 #include "BtRtl.h"
+#include "RtlBluetoothOps.hpp"
+#include "RtlSetupScheduler.h"
+#include "RtlPatchCache.h"
+#include "FwData.h"
 #include <IOKit/usb/IOUSBHostDevice.h>
 #include <libkern/libkern.h>
 #include "Hci.h"
@@ -9,28 +13,32 @@
 // Define the metadata for our new class
 OSDefineMetaClassAndStructors(RealtekBluetoothFirmware, IOService)
 
-// A structure to hold the device matching information
-struct USBDeviceID {
-    uint16_t vendorID;
-    uint16_t productID;
-};
-
-// This is the new home for the list of supported devices.
-// It's moved from Info.plist to be more like IntelBluetoothFirmware.
-// You can add new devices here.
-static const USBDeviceID supportedDevices[] = {
-    { 0x0BDA, 0x8761 }, // 34657
-    { 0x0BDA, 0x8821 }, // 34849
-    { 0x0BDA, 0xB720 }, // 46880
-    { 0x0BDA, 0xB723 }, // 46883
-    { 0x0BDA, 0xB728 }, // 46888
-    { 0x0BDA, 0xB822 }, // 47138
-    { 0x0BDA, 0xC821 }, // 51233
-    { 0x0BDA, 0xC82C }, // 51244
-    { 0x0BDA, 0xD723 }, // 55075
-    { 0x0BDA, 0x1724 }  // 5924
-    // Add new { VendorID, ProductID } pairs here
-};
+// Live instances; the shared state goes away with the last one
+static volatile SInt32 gRtlInstances;
+
+bool RealtekBluetoothFirmware::init(OSDictionary *dictionary)
+{
+    // Counted even if init fails, free() follows either way
+    OSIncrementAtomic(&gRtlInstances);
+    if (!super::init(dictionary)) {
+        return false;
+    }
+    m_pControllerLock = IOLockAlloc();
+    return m_pControllerLock != nullptr;
+}
+
+void RealtekBluetoothFirmware::free()
+{
+    // Nothing is left to use the patch cache, free it before the kext can unload
+    if (OSDecrementAtomic(&gRtlInstances) == 1) {
+        RtlPatchCache::shared()->teardown();
+    }
+    if (m_pControllerLock) {
+        IOLockFree(m_pControllerLock);
+        m_pControllerLock = nullptr;
+    }
+    super::free();
+}
 
 IOService *RealtekBluetoothFirmware::probe(IOService *provider, SInt32 *score)
 {
@@ -50,20 +58,18 @@ IOService *RealtekBluetoothFirmware::probe(IOService *provider, SInt32 *score)
     uint16_t vendorID = m_pUSBDevice->getDeviceDescriptor()->idVendor;
     uint16_t productID = m_pUSBDevice->getDeviceDescriptor()->idProduct;
 
-    // Check if the device is in our supported list
-    for (int i = 0; i < sizeof(supportedDevices) / sizeof(USBDeviceID); i++) {
-        if (vendorID == supportedDevices[i].vendorID && productID == supportedDevices[i].productID) {
-            XYLog("Found a supported Realtek device: VID=0x%04x, PID=0x%04x\n", vendorID, productID);
-            
-            // Increase the probe score to make sure this driver is chosen
-            *score += 2000;
-            
-            return this;
-        }
+    // Check if the device is in the generated device table
+    const FwDevice *device = findFWDevice(vendorID, productID);
+    if (!device) {
+        // Not a supported device
+        return nullptr;
     }
+    XYLog("Found a supported Realtek device: VID=0x%04x, PID=0x%04x (%s)\n", vendorID, productID, device->chip->name);
 
-    // Not a supported device
-    return nullptr;
+    // Increase the probe score to make sure this driver is chosen
+    *score += 2000;
+
+    return this;
 }
 
 bool RealtekBluetoothFirmware::start(IOService *provider)
@@ -83,33 +89,115 @@ bool RealtekBluetoothFirmware::start(IOService *provider)
     }
 
     // Now, create the controller object which will handle the actual work.
-    // This is where we delegate the task to the old BtRtl class.
-    m_pController = new BtRtl();
-    if (!m_pController) {
+    BtRtl *controller = new RtlBluetoothOps();
+    if (!controller) {
         XYLog("Failed to allocate BtRtl controller\n");
         return false;
     }
 
     // Initialize the controller with the USB device
-    if (!m_pController->initWithDevice(this, m_pUSBDevice)) {
+    if (!controller->initWithDevice(this, m_pUSBDevice)) {
         XYLog("Failed to initialize BtRtl controller\n");
-        OSSafeReleaseNULL(m_pController);
+        OSSafeReleaseNULL(controller);
         return false;
     }
 
+    // Visible to property readers only once it is ready for them
+    IOLockLock(m_pControllerLock);
+    m_pController = controller;
+    IOLockUnlock(m_pControllerLock);
+
+    // The download takes a while, keep it off the matching thread.
+    setProperty("FirmwareState", "Loading");
+    if (!RtlSetupScheduler::shared()->submit(this, usbBus(), bringUp)) {
+        XYLog("No setup worker available, loading firmware inline\n");
+        bringUp(this);
+    }
+
     XYLog("RealtekBluetoothFirmware driver started successfully\n");
     return true;
 }
 
+void RealtekBluetoothFirmware::bringUp(OSObject *owner)
+{
+    RealtekBluetoothFirmware *that = OSDynamicCast(RealtekBluetoothFirmware, owner);
+    bool ready;
+
+    if (!that || !that->m_pController) {
+        return;
+    }
+    ready = that->m_pController->setupFirmware();
+    if (!ready) {
+        XYLog("Failed to setup firmware\n");
+    }
+    // Readiness is published even on failure so waiters are not left hanging.
+    that->setProperty("FirmwareLoaded", ready);
+    that->setProperty("FirmwareState", ready ? "Ready" : "Failed");
+    that->registerService();
+}
+
+uint32_t RealtekBluetoothFirmware::usbBus()
+{
+    OSNumber *location = OSDynamicCast(OSNumber, m_pUSBDevice->getProperty("locationID"));
+
+    return location ? location->unsigned32BitValue() >> 24 : 0;
+}
+
 void RealtekBluetoothFirmware::stop(IOService *provider)
 {
     XYLog("Stopping RealtekBluetoothFirmware driver\n");
 
-    // Clean up the controller object
-    if (m_pController) {
-        m_pController->release();
-        m_pController = nullptr;
-    }
+    // Drop a queued bring-up, or wait for the running one to return
+    RtlSetupScheduler::shared()->cancel(this);
+
+    // Clean up the controller object; a property reader may still hold a reference
+    IOLockLock(m_pControllerLock);
+    BtRtl *controller = m_pController;
+    m_pController = nullptr;
+    IOLockUnlock(m_pControllerLock);
+    OSSafeReleaseNULL(controller);
 
     super::stop(provider);
 }
+
+BtRtl *RealtekBluetoothFirmware::copyController() const
+{
+    BtRtl *controller;
+
+    IOLockLock(m_pControllerLock);
+    controller = m_pController;
+    if (controller) {
+        controller->retain();
+    }
+    IOLockUnlock(m_pControllerLock);
+    return controller;
+}
+
+bool RealtekBluetoothFirmware::serializeProperties(OSSerialize *s) const
+{
+    BtRtl *controller = copyController();
+    OSDictionary *stats;
+    OSDictionary *props;
+    bool ok;
+
+    if (!controller) {
+        return super::serializeProperties(s);
+    }
+    stats = controller->copyHciStats();
+    controller->release();
+    if (!stats) {
+        return super::serializeProperties(s);
+    }
+
+    // The snapshot goes into a copy; the registry itself is left untouched
+    props = dictionaryWithProperties();
+    if (!props) {
+        stats->release();
+        return false;
+    }
+    props->setObject("HCIStatistics", stats);
+    stats->release();
+    ok = props->serialize(s);
+    props->release();
+    return ok;
+}
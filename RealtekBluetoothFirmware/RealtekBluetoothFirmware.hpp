@@ -14,21 +14,52 @@ private:
      */
     BtRtl *m_pController;
 
+    /**
+     *  Guards m_pController between stop() and property readers, which
+     *  I/O Kit runs on their own threads.
+     */
+    IOLock *m_pControllerLock;
+
+    /**
+     *  The controller with a reference taken, or NULL once stopped.
+     */
+    BtRtl *copyController() const;
+
     /**
      *  The USB device object provided by I/O Kit.
      */
     IOUSBHostDevice *m_pUSBDevice;
 
+    /**
+     *  Runs on a setup worker: downloads the firmware and publishes the result.
+     */
+    static void bringUp(OSObject *owner);
+
+    /**
+     *  The USB bus the device sits on, the top byte of its locationID.
+     */
+    uint32_t usbBus();
+
 public:
+    virtual bool init(OSDictionary *dictionary = nullptr) override;
+
+    /**
+     *  The last instance to go also frees the state shared between
+     *  controllers, which would otherwise outlive the kext.
+     */
+    virtual void free() override;
+
     /**
      *  Called by I/O Kit to determine if this driver should attach to the given provider.
-     *  We will perform device matching based on VID/PID here.
+     *  The generated personalities already match on VID/PID, so this only runs for
+     *  devices in the table; it checks again and bumps the score.
      */
     virtual IOService *probe(IOService *provider, SInt32 *score) override;
 
     /**
      *  Called by I/O Kit when the driver is attaching to the provider.
-     *  This is where we initialize the controller and start the firmware upload process.
+     *  This is where we initialize the controller and queue the firmware upload.
+     *  The upload runs on a setup worker; FirmwareState reports its progress.
      */
     virtual bool start(IOService *provider) override;
 
@@ -37,6 +68,12 @@ public:
      *  We clean up our resources here.
      */
     virtual void stop(IOService *provider) override;
+
+    /**
+     *  Adds a fresh HCIStatistics snapshot to the properties every time user
+     *  space reads them, so ioreg always shows live numbers.
+     */
+    virtual bool serializeProperties(OSSerialize *s) const override;
 };
 
 #endif /* RealtekBluetoothFirmware_hpp */
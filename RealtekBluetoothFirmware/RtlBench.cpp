@@ -0,0 +1,127 @@
+//
+//  RtlBench.cpp
+//  RtlBluetoothFirmware
+//
+//  Bring-up latency benchmark, see RtlBench.h.
+//
+
+#include "RtlBench.h"
+#include "RtlCore.h"
+#include "RtlPatchCache.h"
+#include "Log.h"
+#include "FwData.h"
+
+static void
+rtlSortNs(uint64_t *values, uint32_t count)
+{
+    for (uint32_t i = 1; i < count; i++) {
+        uint64_t v = values[i];
+        uint32_t j = i;
+        while (j > 0 && values[j - 1] > v) {
+            values[j] = values[j - 1];
+            j--;
+        }
+        values[j] = v;
+    }
+}
+
+static uint64_t
+rtlPercentileNs(const uint64_t *sorted, uint32_t count, uint32_t pct)
+{
+    return count ? sorted[(uint64_t)(count - 1) * pct / 100] : 0;
+}
+
+bool
+rtlBenchBringUp(const FwPatchIndex *entry, const RtlSimLatency *model, uint32_t runs, RtlBenchResult *result)
+{
+    const RtlChipId *id = rtlFindChipId(entry->patch.name);
+    uint64_t *total;
+    uint64_t *bus;
+    uint32_t done = 0;
+
+    memset(result, 0, sizeof(*result));
+    result->name = entry->patch.name;
+    result->lmpSubversion = entry->lmp_subversion;
+    result->romVersion = entry->rom_version;
+    result->runs = runs;
+    if (!runs || !id) {
+        return false;
+    }
+    total = (uint64_t *)IOMalloc(runs * sizeof(uint64_t));
+    bus = (uint64_t *)IOMalloc(runs * sizeof(uint64_t));
+    if (!total || !bus) {
+        if (total) {
+            IOFree(total, runs * sizeof(uint64_t));
+        }
+        if (bus) {
+            IOFree(bus, runs * sizeof(uint64_t));
+        }
+        return false;
+    }
+
+    for (uint32_t i = 0; i < runs; i++) {
+        // Reports the local version of the chip the patch is for, before patching
+        RtlSimController sim(id->lmpSubver, id->hciRev, id->hciVer, entry->rom_version);
+        RtlCore core(&sim);
+        uint64_t start;
+        uint64_t cpu;
+
+        RtlPatchCache::shared()->purge();
+        sim.setLatencyModel(model, i + 1);
+        start = RtlMonotonicNs();
+        if (!core.setupFirmware()) {
+            result->failures++;
+            continue;
+        }
+        cpu = RtlMonotonicNs() - start;
+        total[done] = cpu + sim.elapsedNs();
+        bus[done] = sim.elapsedNs();
+        done++;
+        result->commands = sim.commandCount();
+        result->bytes = sim.downloadedBytes();
+    }
+
+    rtlSortNs(total, done);
+    rtlSortNs(bus, done);
+    result->p50Ns = rtlPercentileNs(total, done, 50);
+    result->p99Ns = rtlPercentileNs(total, done, 99);
+    result->busP50Ns = rtlPercentileNs(bus, done, 50);
+    IOFree(total, runs * sizeof(uint64_t));
+    IOFree(bus, runs * sizeof(uint64_t));
+    return result->failures == 0;
+}
+
+bool
+rtlBenchAll(const RtlSimLatency *model, uint32_t runs, uint64_t budgetNs)
+{
+    RtlBenchResult result;
+    uint32_t benched = 0;
+    bool ok = true;
+
+    for (uint32_t i = 0; i <= fwPatchIndexMask; i++) {
+        const FwPatchIndex *entry = &fwPatchIndex[i];
+        if (!entry->patch.var) {
+            continue;
+        }
+        if (!rtlBenchBringUp(entry, model, runs, &result)) {
+            ok = false;
+        }
+        if (budgetNs && result.p99Ns > budgetNs) {
+            ok = false;
+        }
+        XYLog("bench %s lmp_subversion 0x%04x ROM 0x%02x: %u runs, %u failed, %u commands, %u bytes, "
+              "p50 %llu us (bus %llu us), p99 %llu us%s\n",
+              result.name, result.lmpSubversion, result.romVersion, result.runs, result.failures,
+              result.commands, result.bytes, (unsigned long long)(result.p50Ns / 1000),
+              (unsigned long long)(result.busP50Ns / 1000), (unsigned long long)(result.p99Ns / 1000),
+              budgetNs && result.p99Ns > budgetNs ? " OVER BUDGET" : "");
+        benched++;
+    }
+    // Measuring nothing is not a pass
+    if (!benched) {
+        XYLog("bench found no embedded patches\n");
+        ok = false;
+    }
+    XYLog("bench %u patches, %s\n", benched, ok ? "pass" : "fail");
+    return ok;
+}
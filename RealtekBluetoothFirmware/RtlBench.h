@@ -0,0 +1,45 @@
+//
+//  RtlBench.h
+//  RtlBluetoothFirmware
+//
+//  Bring-up latency benchmark for host builds. Runs the real RtlCore
+//  setupFirmware sequence for every patch in the build-time index against
+//  RtlSimController with a USB latency model, and reports p50/p99 of the
+//  total bring-up time (simulated bus time plus the host CPU time spent in
+//  the loader).
+//
+
+#ifndef RtlBench_h
+#define RtlBench_h
+
+#include "RtlSimController.h"
+
+struct FwPatchIndex;
+
+typedef struct {
+    const char  *name;
+    uint16_t    lmpSubversion;
+    uint8_t     romVersion;
+    uint32_t    runs;
+    uint32_t    failures;
+    uint32_t    commands;
+    uint32_t    bytes;
+    uint64_t    p50Ns;
+    uint64_t    p99Ns;
+    uint64_t    busP50Ns;   // simulated bus and controller share of p50
+} RtlBenchResult;
+
+/*
+ * Cold bring-up of one indexed patch, runs times. The patch cache is
+ * purged before every run so each one inflates and downloads in full.
+ */
+bool rtlBenchBringUp(const FwPatchIndex *entry, const RtlSimLatency *model, uint32_t runs, RtlBenchResult *result);
+
+/*
+ * Benchmark every indexed patch and log one line each. Returns false if
+ * there was none, if any bring-up failed or, with budgetNs set, took
+ * longer than that at p99, so a CI job can gate on it (host/RtlBenchMain).
+ */
+bool rtlBenchAll(const RtlSimLatency *model, uint32_t runs, uint64_t budgetNs);
+
+#endif /* RtlBench_h */
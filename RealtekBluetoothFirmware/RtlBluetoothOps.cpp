@@ -6,6 +6,7 @@
 //
 
 #include "RtlBluetoothOps.hpp"
+#include "FwData.h"
 #include <libkern/OSMalloc.h>
 #include <IOKit/IOLib.h>
 
@@ -52,22 +53,11 @@ bool RtlBluetoothOps::shutdown() {
 }
 
 bool RtlBluetoothOps::getFirmwareName(char *fwname, size_t len) {
-    // TODO: This is a critical part. You need to read the device's
-    // USB Vendor ID, Product ID, and possibly bcdDevice (device version)
-    // to determine which firmware file to load.
-    
-    // The USBDeviceController should have access to this information.
-    // For now, we will use a placeholder name.
-    
-    // Example of how you might get device info (pseudo-code):
-    // uint16_t vendorID = m_pUSBDeviceController->getVendorID();
-    // uint16_t productID = m_pUSBDeviceController->getProductID();
-    // if (vendorID == 0x0BDA && productID == 0x1234) {
-    //     strlcpy(fwname, "rtl_chip_a.bin", len);
-    // } else {
-    //     strlcpy(fwname, "default_rtl_fw.bin", len);
-    // }
-
-    strlcpy(fwname, "rtl8723b_fw.bin", len);
+    // The chip comes from the generated device table, matched on VID/PID
+    // in initWithDevice, so this needs no HCI round trip.
+    if (!m_pDevice || !m_pDevice->chip->firmware) {
+        return false;
+    }
+    strlcpy(fwname, m_pDevice->chip->firmware, len);
     return true;
 }
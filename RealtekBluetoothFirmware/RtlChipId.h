@@ -0,0 +1,170 @@
+//
+//  RtlChipId.h
+//  RtlBluetoothFirmware
+//
+//  Chip identification from one HCI_OP_READ_LOCAL_VERSION response, as in
+//  the ic_id_table of linux/drivers/bluetooth/btrtl.c. lmp_subver alone is
+//  ambiguous (8723B/8723D, 8821A/8821C...), so the key is (lmp_subver,
+//  hci_rev, hci_ver, bus). The table is hashed at compile time and looked
+//  up in O(1). generate_fw_data.py reads the RTL_CHIP_ID lines below to
+//  know which firmware to embed, so they must stay one entry per line.
+//
+
+#ifndef RtlChipId_h
+#define RtlChipId_h
+
+#include "RtlPlatform.h"
+#include "RtlTransport.h"
+
+/* RtlChipId::quirks and FwChip::quirks */
+enum FwChipQuirk {
+    FW_CHIP_NO_ROM_VERSION = 1 << 0,    // no HCI_OP_RTL_READ_ROM_VERSION, ROM version 0
+    FW_CHIP_CONFIG_NEEDED = 1 << 1,     // does not come up without its config blob
+    FW_CHIP_RAW_PATCH = 1 << 2,         // firmware is no epatch, the whole file is sent
+};
+
+typedef struct {
+    const char  *name;
+    uint16_t    lmpSubver;
+    uint16_t    hciRev;
+    uint8_t     hciVer;
+    uint8_t     bus;        // RtlBus
+    const char  *firmware;
+    const char  *config;    // NULL when the chip takes none
+    uint32_t    quirks;
+} RtlChipId;
+
+#define RTL_CHIP_ID(name, lmp, rev, ver, bus, fw, cfg, quirks) \
+    { name, lmp, rev, ver, bus, fw, cfg, quirks }
+
+static constexpr RtlChipId rtlChipIds[] = {
+    RTL_CHIP_ID("RTL8723A", 0x1200, 0xb, 0x6, RTL_BUS_USB, "rtl8723a_fw.bin", NULL, FW_CHIP_NO_ROM_VERSION | FW_CHIP_RAW_PATCH),
+    RTL_CHIP_ID("RTL8723B", 0x8723, 0xb, 0x6, RTL_BUS_USB, "rtl8723b_fw.bin", "rtl8723b_config.bin", 0),
+    RTL_CHIP_ID("RTL8723D", 0x8723, 0xd, 0x8, RTL_BUS_USB, "rtl8723d_fw.bin", "rtl8723d_config.bin", 0),
+    RTL_CHIP_ID("RTL8821A", 0x8821, 0xa, 0x6, RTL_BUS_USB, "rtl8821a_fw.bin", "rtl8821a_config.bin", 0),
+    RTL_CHIP_ID("RTL8821C", 0x8821, 0xc, 0x8, RTL_BUS_USB, "rtl8821c_fw.bin", "rtl8821c_config.bin", 0),
+    RTL_CHIP_ID("RTL8761A", 0x8761, 0xa, 0x6, RTL_BUS_USB, "rtl8761a_fw.bin", "rtl8761a_config.bin", 0),
+    RTL_CHIP_ID("RTL8761B", 0x8761, 0xb, 0xa, RTL_BUS_USB, "rtl8761bu_fw.bin", "rtl8761bu_config.bin", 0),
+    RTL_CHIP_ID("RTL8822B", 0x8822, 0xb, 0x7, RTL_BUS_USB, "rtl8822b_fw.bin", "rtl8822b_config.bin", FW_CHIP_CONFIG_NEEDED),
+    RTL_CHIP_ID("RTL8822C", 0x8822, 0xc, 0xa, RTL_BUS_USB, "rtl8822cu_fw.bin", "rtl8822cu_config.bin", FW_CHIP_CONFIG_NEEDED),
+    RTL_CHIP_ID("RTL8852A", 0x8852, 0xa, 0xb, RTL_BUS_USB, "rtl8852au_fw.bin", "rtl8852au_config.bin", FW_CHIP_CONFIG_NEEDED),
+};
+
+#define RTL_CHIP_ID_COUNT   (sizeof(rtlChipIds) / sizeof(rtlChipIds[0]))
+#define RTL_CHIP_ID_SLOTS   32
+
+static constexpr uint32_t rtlChipIdHash(uint16_t lmpSubver, uint16_t hciRev, uint8_t hciVer, uint8_t bus)
+{
+    /* The top 5 bits pick one of the RTL_CHIP_ID_SLOTS slots. */
+    return (((uint32_t)lmpSubver << 16 | hciRev) * 0x9e3779b1u ^ ((uint32_t)hciVer << 8 | bus) * 0x85ebca6bu) >> 27;
+}
+
+typedef struct {
+    int8_t      slot[RTL_CHIP_ID_SLOTS];
+} RtlChipIdIndex;
+
+/* Open addressing with linear probing, filled at compile time. */
+static constexpr RtlChipIdIndex rtlBuildChipIdIndex()
+{
+    RtlChipIdIndex index = {};
+
+    for (uint32_t i = 0; i < RTL_CHIP_ID_SLOTS; i++) {
+        index.slot[i] = -1;
+    }
+    for (uint32_t i = 0; i < RTL_CHIP_ID_COUNT; i++) {
+        const RtlChipId &id = rtlChipIds[i];
+        uint32_t slot = rtlChipIdHash(id.lmpSubver, id.hciRev, id.hciVer, id.bus);
+        while (index.slot[slot] >= 0) {
+            slot = (slot + 1) % RTL_CHIP_ID_SLOTS;
+        }
+        index.slot[slot] = (int8_t)i;
+    }
+    return index;
+}
+
+static constexpr bool rtlChipIdsUnique()
+{
+    for (uint32_t i = 0; i < RTL_CHIP_ID_COUNT; i++) {
+        for (uint32_t j = i + 1; j < RTL_CHIP_ID_COUNT; j++) {
+            if (rtlChipIds[i].lmpSubver == rtlChipIds[j].lmpSubver && rtlChipIds[i].hciRev == rtlChipIds[j].hciRev &&
+                rtlChipIds[i].hciVer == rtlChipIds[j].hciVer && rtlChipIds[i].bus == rtlChipIds[j].bus) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static constexpr bool rtlNameHasAffixes(const char *name, const char *prefix, const char *suffix)
+{
+    uint32_t len = 0, prefixLen = 0, suffixLen = 0;
+
+    while (name[len]) {
+        len++;
+    }
+    while (prefix[prefixLen]) {
+        if (name[prefixLen] != prefix[prefixLen]) {
+            return false;
+        }
+        prefixLen++;
+    }
+    while (suffix[suffixLen]) {
+        suffixLen++;
+    }
+    if (len < prefixLen + suffixLen) {
+        return false;
+    }
+    for (uint32_t i = 0; i < suffixLen; i++) {
+        if (name[len - suffixLen + i] != suffix[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* linux-firmware rtl_bt names, which is what generate_fw_data.py embeds. */
+static constexpr bool rtlChipIdFilesNamed()
+{
+    for (uint32_t i = 0; i < RTL_CHIP_ID_COUNT; i++) {
+        if (!rtlChipIds[i].firmware || !rtlNameHasAffixes(rtlChipIds[i].firmware, "rtl", "_fw.bin")) {
+            return false;
+        }
+        if (rtlChipIds[i].config && !rtlNameHasAffixes(rtlChipIds[i].config, "rtl", "_config.bin")) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(RTL_CHIP_ID_COUNT * 2 <= RTL_CHIP_ID_SLOTS, "chip identity index more than half full");
+static_assert(rtlChipIdsUnique(), "two chips with the same identity");
+static_assert(rtlChipIdFilesNamed(), "chip firmware or config is not an rtl_bt file name");
+
+static constexpr RtlChipIdIndex rtlChipIdIndex = rtlBuildChipIdIndex();
+
+static inline const RtlChipId *rtlIdentifyChip(uint16_t lmpSubver, uint16_t hciRev, uint8_t hciVer, uint8_t bus)
+{
+    uint32_t slot = rtlChipIdHash(lmpSubver, hciRev, hciVer, bus);
+
+    while (rtlChipIdIndex.slot[slot] >= 0) {
+        const RtlChipId *id = &rtlChipIds[rtlChipIdIndex.slot[slot]];
+        if (id->lmpSubver == lmpSubver && id->hciRev == hciRev && id->hciVer == hciVer && id->bus == bus) {
+            return id;
+        }
+        slot = (slot + 1) % RTL_CHIP_ID_SLOTS;
+    }
+    return NULL;
+}
+
+/* The identity a firmware file belongs to, for tools that start from a patch. */
+static inline const RtlChipId *rtlFindChipId(const char *firmware)
+{
+    for (uint32_t i = 0; i < RTL_CHIP_ID_COUNT; i++) {
+        if (strcmp(rtlChipIds[i].firmware, firmware) == 0) {
+            return &rtlChipIds[i];
+        }
+    }
+    return NULL;
+}
+
+#endif /* RtlChipId_h */
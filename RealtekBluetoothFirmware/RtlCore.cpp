@@ -0,0 +1,1393 @@
+//
+//  RtlCore.cpp
+//  RtlBluetoothFirmware
+//
+//  Portable firmware loader pipeline, see RtlCore.h.
+//
+
+#include "RtlCore.h"
+#include "RtlPatchCache.h"
+#include "Log.h"
+#include "FwData.h"
+
+RtlCore::
+RtlCore(RtlTransport *transport)
+: m_pTransport(transport), m_pendingHead(0), m_pendingCount(0), m_credits(1), m_pipelineError(false),
+  m_eventHead(0), m_eventCount(0), m_eventsDropped(0), m_delivering(false), m_lastReadError(kIOReturnSuccess),
+  m_pChip(NULL)
+{
+    memset(&m_waiter, 0, sizeof(m_waiter));
+    memset(m_handlers, 0, sizeof(m_handlers));
+}
+
+/* Bytes kept from the end of a streamed v1 image to find the project ID. */
+#define RTL_EXT_WINDOW 64
+
+static const uint8_t rtlExtensionSig[] = { 0x51, 0x04, 0xfd, 0x77 };
+
+void RtlCore::
+releaseFwData(RtlFwData *data)
+{
+    if (data) {
+        if (data->alloc) {
+            IOFree(data->alloc, data->allocSize);
+        }
+        data->bytes = NULL;
+        data->length = 0;
+        data->alloc = NULL;
+        data->allocSize = 0;
+    }
+}
+
+void RtlCore::
+releaseFwPatch(RtlFwPatch *patch)
+{
+    if (patch) {
+        releaseFwData(&patch->storage);
+        patch->numSegments = 0;
+        patch->length = 0;
+        patch->tailLength = 0;
+    }
+}
+
+bool RtlEpatchV2Iterator::
+init(const uint8_t *fw, uint32_t len)
+{
+    const rtl_epatch_header_v2 *hdr = (const rtl_epatch_header_v2 *)fw;
+
+    m_truncated = false;
+    m_subsecsLeft = 0;
+    m_pSectionCur = m_pSectionEnd = NULL;
+    if (len < sizeof(*hdr) ||
+        memcmp(hdr->signature, RTL_EPATCH_SIGNATURE_V2, sizeof(RTL_EPATCH_SIGNATURE_V2) - 1) != 0) {
+        return false;
+    }
+    m_pFwVersion = hdr->fw_version;
+    m_sectionsLeft = OSSwapLittleToHostInt32(hdr->num_sections);
+    m_pCur = fw + sizeof(*hdr);
+    m_pEnd = fw + len;
+    return true;
+}
+
+bool RtlEpatchV2Iterator::
+nextSection()
+{
+    while (m_sectionsLeft > 0) {
+        const rtl_section *section = (const rtl_section *)m_pCur;
+        const rtl_section_hdr *hdr;
+        uint32_t section_len;
+
+        m_sectionsLeft--;
+        if ((uint32_t)(m_pEnd - m_pCur) < sizeof(*section)) {
+            m_truncated = true;
+            return false;
+        }
+        section_len = OSSwapLittleToHostInt32(section->len);
+        if ((uint32_t)(m_pEnd - section->data) < section_len) {
+            m_truncated = true;
+            return false;
+        }
+        m_opcode = OSSwapLittleToHostInt32(section->opcode);
+        m_pCur = section->data + section_len;
+
+        switch (m_opcode) {
+            case RTL_PATCH_SNIPPETS:
+            case RTL_PATCH_DUMMY_HEADER:
+            case RTL_PATCH_SECURITY_HEADER:
+                break;
+            default:
+                continue;
+        }
+        if (section_len < sizeof(*hdr)) {
+            m_truncated = true;
+            return false;
+        }
+        hdr = (const rtl_section_hdr *)section->data;
+        m_subsecsLeft = OSSwapLittleToHostInt16(hdr->num);
+        m_pSectionCur = section->data + sizeof(*hdr);
+        m_pSectionEnd = section->data + section_len;
+        return true;
+    }
+    return false;
+}
+
+bool RtlEpatchV2Iterator::
+next(RtlSubsection *subsec)
+{
+    while (m_subsecsLeft == 0) {
+        if (m_truncated || !nextSection()) {
+            return false;
+        }
+    }
+
+    const rtl_common_subsec *common = (const rtl_common_subsec *)m_pSectionCur;
+    uint32_t sec_len;
+
+    m_subsecsLeft--;
+    if ((uint32_t)(m_pSectionEnd - m_pSectionCur) < sizeof(*common)) {
+        m_truncated = true;
+        return false;
+    }
+    sec_len = OSSwapLittleToHostInt32(common->len);
+    if ((uint32_t)(m_pSectionEnd - common->data) < sec_len) {
+        m_truncated = true;
+        return false;
+    }
+    subsec->opcode = m_opcode;
+    subsec->eco = common->eco;
+    subsec->prio = common->prio;
+    subsec->keyId = ((const rtl_sec_hdr *)common)->key_id;
+    subsec->data = common->data;
+    subsec->length = sec_len;
+    m_pSectionCur = common->data + sec_len;
+    return true;
+}
+
+bool RtlCore::
+sendHCISync(HciCommandHdr *cmd, void *event, uint32_t eventBufSize, uint32_t *size, int timeout)
+{
+    return sendHCISyncEvent(cmd, event, eventBufSize, size, 0, timeout);
+}
+
+bool RtlCore::
+sendHCISyncEvent(HciCommandHdr *cmd, void *event, uint32_t eventBufSize, uint32_t *size, uint8_t syncEvent, int timeout)
+{
+    uint16_t opcode = OSSwapLittleToHostInt16(cmd->opcode);
+    uint64_t start;
+    bool ret;
+
+    if (!flushCommands(timeout)) {
+        return false;
+    }
+    start = RtlMonotonicNs();
+    m_lastReadError = kIOReturnSuccess;
+    ret = submitCommand(cmd, timeout) && waitFor(syncEvent, opcode, event, eventBufSize, size, timeout);
+    recordCommand(opcode, start, ret && !m_waiter.status);
+    deliverEvents();
+    return ret;
+}
+
+bool RtlCore::
+submitCommand(HciCommandHdr *cmd, int timeout)
+{
+    IOReturn ret;
+    RTL_TRACE_DBG(m_trace, RTL_TRACE_CMD_SUBMIT, OSSwapLittleToHostInt16(cmd->opcode), cmd->len, m_credits);
+    m_snoop.record(RTL_SNOOP_H4_COMMAND, false, cmd, HCI_COMMAND_HDR_SIZE + cmd->len);
+    if ((ret = m_pTransport->sendHCIRequest(cmd, timeout)) != kIOReturnSuccess) {
+        XYLog("%s sendHCIRequest failed: %s %d\n", __FUNCTION__, m_pTransport->stringFromReturn(ret), ret);
+        return false;
+    }
+    return true;
+}
+
+/* Dispatch events until the one described by event/opcode shows up. */
+bool RtlCore::
+waitFor(uint8_t event, uint16_t opcode, void *buf, uint32_t bufSize, uint32_t *size, int timeout)
+{
+    m_waiter.active = true;
+    m_waiter.done = false;
+    m_waiter.event = event;
+    m_waiter.opcode = opcode;
+    m_waiter.buf = (uint8_t *)buf;
+    m_waiter.bufSize = bufSize;
+    m_waiter.len = 0;
+    m_waiter.status = 0;
+    while (!m_waiter.done) {
+        if (!dispatchEvent(timeout)) {
+            m_waiter.active = false;
+            return false;
+        }
+    }
+    m_waiter.active = false;
+    if (size) {
+        *size = m_waiter.len;
+    }
+    return true;
+}
+
+void RtlCore::
+recordCommand(uint16_t opcode, uint64_t startNs, bool ok)
+{
+    m_stats.record(opcode, startNs, ok, !ok && m_lastReadError == kIOReturnTimeout);
+}
+
+bool RtlCore::
+bulkHCISync(HciCommandHdr *cmd, void *event, uint32_t eventBufSize, uint32_t *size, int timeout)
+{
+    const void *bytes = NULL;
+    uint32_t len = 0;
+    bool ok = bulkExchange(cmd, false, event ? &bytes : NULL, &len, timeout);
+    return copyBulkEvent(ok, bytes, len, event, eventBufSize, size);
+}
+
+bool RtlCore::
+bulkHCIBorrow(HciCommandHdr *cmd, const void **event, uint32_t *size, int timeout)
+{
+    return bulkExchange(cmd, false, event, size, timeout);
+}
+
+void RtlCore::
+releaseBulkEvent(const void *event)
+{
+    if (event && event != m_bulkEvent) {
+        m_pTransport->releaseBulkReadBuffer((void *)event);
+    }
+}
+
+HciCommandHdr *RtlCore::
+acquireBulkCommand(uint32_t capacity)
+{
+    uint32_t available = 0;
+    void *bytes = m_pTransport->acquireBulkBuffer(&available);
+
+    if (bytes && available < capacity) {
+        m_pTransport->releaseBulkBuffer(bytes);
+        bytes = NULL;
+    }
+    return (HciCommandHdr *)bytes;
+}
+
+bool RtlCore::
+submitBulkCommand(HciCommandHdr *cmd, void *event, uint32_t eventBufSize, uint32_t *size, int timeout)
+{
+    const void *bytes = NULL;
+    uint32_t len = 0;
+    bool ok = bulkExchange(cmd, true, event ? &bytes : NULL, &len, timeout);
+    return copyBulkEvent(ok, bytes, len, event, eventBufSize, size);
+}
+
+void RtlCore::
+releaseBulkCommand(HciCommandHdr *cmd)
+{
+    m_pTransport->releaseBulkBuffer(cmd);
+}
+
+/*
+ * cmd is gone once sent in place, everything needed from it is read first.
+ * A caller that passes no event gets its response released right away.
+ */
+bool RtlCore::
+bulkExchange(HciCommandHdr *cmd, bool inPlace, const void **event, uint32_t *size, int timeout)
+{
+    uint16_t opcode = OSSwapLittleToHostInt16(cmd->opcode);
+    uint32_t length = HCI_COMMAND_HDR_SIZE + cmd->len;
+    uint64_t start = RtlMonotonicNs();
+    const void *bytes = NULL;
+    uint32_t len = 0;
+    IOReturn ret;
+    m_snoop.record(RTL_SNOOP_H4_COMMAND, false, cmd, length);
+    ret = inPlace ? m_pTransport->submitBulkBuffer(cmd, length, timeout) : m_pTransport->bulkWrite(cmd, length, timeout);
+    if (ret != kIOReturnSuccess) {
+        XYLog("%s bulk write failed: %s %d\n", __FUNCTION__, m_pTransport->stringFromReturn(ret), ret);
+    } else if ((ret = readBulkEvent(&bytes, &len, timeout)) != kIOReturnSuccess) {
+        XYLog("%s bulk read failed: %s %d\n", __FUNCTION__, m_pTransport->stringFromReturn(ret), ret);
+    } else if (event) {
+        *event = bytes;
+    } else {
+        releaseBulkEvent(bytes);
+    }
+    if (size) {
+        *size = ret == kIOReturnSuccess ? len : 0;
+    }
+    if (ret == kIOReturnTimeout) {
+        m_stats.countTimeout();
+    }
+    m_stats.record(opcode, start, ret == kIOReturnSuccess, ret == kIOReturnTimeout);
+    return ret == kIOReturnSuccess;
+}
+
+/* For the callers that want a copy, from the buffer the event was read in. */
+bool RtlCore::
+copyBulkEvent(bool ok, const void *bytes, uint32_t len, void *event, uint32_t eventBufSize, uint32_t *size)
+{
+    if (ok && event && len > eventBufSize) {
+        XYLog("%s %d byte event does not fit in %d\n", __FUNCTION__, len, eventBufSize);
+        ok = false;
+    }
+    if (ok && event) {
+        memcpy(event, bytes, len);
+    }
+    if (size) {
+        *size = ok ? len : 0;
+    }
+    releaseBulkEvent(bytes);
+    return ok;
+}
+
+/*
+ * The response to a bulk command, left in the transport's own buffer when
+ * it has pooled reads and read into m_bulkEvent otherwise. An event that
+ * does not fit there is an overrun, not a cut event.
+ */
+IOReturn RtlCore::
+readBulkEvent(const void **event, uint32_t *size, int timeout)
+{
+    void *bytes = NULL;
+    uint32_t len = 0;
+    IOReturn ret = m_pTransport->bulkReadPooled(&bytes, &len, timeout);
+
+    if (ret == kIOReturnUnsupported) {
+        bytes = m_bulkEvent;
+        ret = m_pTransport->bulkPipeRead(m_bulkEvent, sizeof(m_bulkEvent), &len, timeout);
+    }
+    if (ret != kIOReturnSuccess) {
+        return ret;
+    }
+    m_snoop.record(RTL_SNOOP_H4_EVENT, true, bytes, len);
+    *event = bytes;
+    *size = len;
+    return ret;
+}
+
+bool RtlCore::
+sendCommand(uint16_t opcode, const void *param, uint8_t plen, void *resp, uint32_t respSize, uint32_t *respLen, int timeout)
+{
+    uint8_t buf[CMD_BUF_MAX_SIZE];
+    HciCommandHdr *cmd = (HciCommandHdr *)buf;
+    uint64_t start;
+    bool ret;
+
+    if (plen > CMD_BUF_MAX_SIZE - HCI_COMMAND_HDR_SIZE || !flushCommands(timeout)) {
+        return false;
+    }
+    cmd->opcode = OSSwapHostToLittleInt16(opcode);
+    cmd->len = plen;
+    if (plen) {
+        memcpy(cmd->data, param, plen);
+    }
+    start = RtlMonotonicNs();
+    m_lastReadError = kIOReturnSuccess;
+    ret = submitCommand(cmd, timeout) && waitCommandComplete(opcode, resp, respSize, respLen, timeout);
+    recordCommand(opcode, start, ret && !m_waiter.status);
+    deliverEvents();
+    return ret;
+}
+
+bool RtlCore::
+queueCommand(uint16_t opcode, const void *param, uint8_t plen, int timeout)
+{
+    uint8_t buf[CMD_BUF_MAX_SIZE];
+    HciCommandHdr *cmd = (HciCommandHdr *)buf;
+
+    if (plen > CMD_BUF_MAX_SIZE - HCI_COMMAND_HDR_SIZE) {
+        return false;
+    }
+    cmd->opcode = OSSwapHostToLittleInt16(opcode);
+    cmd->len = plen;
+    if (plen) {
+        memcpy(cmd->data, param, plen);
+    }
+    return queueCommand(cmd, timeout);
+}
+
+bool RtlCore::
+queueCommand(HciCommandHdr *cmd, int timeout)
+{
+    RtlPendingCommand *pending;
+    uint64_t start;
+
+    while (m_credits == 0 || m_pendingCount == RTL_CMD_MAX_PENDING) {
+        if (!dispatchEvent(timeout)) {
+            return false;
+        }
+    }
+    start = RtlMonotonicNs();
+    if (!submitCommand(cmd, timeout)) {
+        m_stats.record(OSSwapLittleToHostInt16(cmd->opcode), start, false, false);
+        return false;
+    }
+    m_credits--;
+    pending = &m_pending[(m_pendingHead + m_pendingCount++) % RTL_CMD_MAX_PENDING];
+    pending->opcode = OSSwapLittleToHostInt16(cmd->opcode);
+    pending->status = 0;
+    pending->completed = false;
+    pending->submittedNs = start;
+    return true;
+}
+
+bool RtlCore::
+flushCommands(int timeout)
+{
+    bool ret;
+
+    m_lastReadError = kIOReturnSuccess;
+    while (m_pendingCount > 0) {
+        if (!dispatchEvent(timeout)) {
+            /* The controller lost track; start over with a single credit. */
+            for (uint32_t i = 0; i < m_pendingCount; i++) {
+                RtlPendingCommand *pending = &m_pending[(m_pendingHead + i) % RTL_CMD_MAX_PENDING];
+                if (!pending->completed) {
+                    recordCommand(pending->opcode, pending->submittedNs, false);
+                }
+            }
+            m_pendingCount = 0;
+            m_credits = 1;
+            m_pipelineError = false;
+            return false;
+        }
+    }
+    ret = !m_pipelineError;
+    m_pipelineError = false;
+    deliverEvents();
+    return ret;
+}
+
+/*
+ * Read one event and route it: a completion goes to the synchronous waiter
+ * or the queued command it belongs to, anything else to the event queue.
+ */
+bool RtlCore::
+dispatchEvent(int timeout)
+{
+    uint8_t evtBuf[HCI_MAX_EVENT_SIZE];
+    uint32_t size = 0;
+    uint16_t opcode = HCI_OP_NOP;
+    uint8_t status = 0;
+    bool completion = false;
+    IOReturn ret;
+
+    if ((ret = m_pTransport->interruptPipeRead(evtBuf, sizeof(evtBuf), &size, timeout)) != kIOReturnSuccess) {
+        XYLog("%s interruptPipeRead failed: %s %d\n", __FUNCTION__, m_pTransport->stringFromReturn(ret), ret);
+        m_lastReadError = ret;
+        RTL_TRACE_ERR(m_trace, RTL_TRACE_READ_FAILED, (uint32_t)ret);
+        if (ret == kIOReturnTimeout) {
+            m_stats.countTimeout();
+        }
+        return false;
+    }
+    m_snoop.record(RTL_SNOOP_H4_EVENT, true, evtBuf, size);
+    if (size < HCI_EVENT_HDR_SIZE) {
+        return true;
+    }
+    if (evtBuf[0] == HCI_EV_CMD_COMPLETE && size >= sizeof(HciResponse)) {
+        HciResponse *evt = (HciResponse *)evtBuf;
+        m_credits = evt->numCommands;
+        opcode = OSSwapLittleToHostInt16(evt->opcode);
+        status = size > sizeof(HciResponse) ? evt->data[0] : 0;
+        completion = true;
+    } else if (evtBuf[0] == HCI_EV_CMD_STATUS && size >= HCI_EVENT_HDR_SIZE + sizeof(HciCmdStatus)) {
+        HciCmdStatus *evt = (HciCmdStatus *)(evtBuf + HCI_EVENT_HDR_SIZE);
+        m_credits = evt->numCommands;
+        opcode = OSSwapLittleToHostInt16(evt->opcode);
+        status = evt->status;
+        completion = true;
+    }
+    if (completion && opcode == HCI_OP_NOP) {
+        return true;
+    }
+    if (completion) {
+        RTL_TRACE_DBG(m_trace, RTL_TRACE_CMD_COMPLETE, opcode, status, m_credits);
+    }
+
+    if (m_waiter.active && !m_waiter.done) {
+        bool match;
+        if (completion) {
+            /* A failing Command Status ends the wait for a Command Complete. */
+            match = opcode == m_waiter.opcode &&
+                    (m_waiter.event == 0 || m_waiter.event == evtBuf[0] ||
+                     (m_waiter.event == HCI_EV_CMD_COMPLETE && status));
+        } else {
+            match = m_waiter.event == evtBuf[0];
+        }
+        if (match) {
+            m_waiter.len = size < m_waiter.bufSize ? size : m_waiter.bufSize;
+            m_waiter.status = status;
+            if (m_waiter.buf) {
+                memcpy(m_waiter.buf, evtBuf, m_waiter.len);
+            }
+            m_waiter.done = true;
+            return true;
+        }
+        if (completion && opcode == m_waiter.opcode) {
+            /* Command Status on the way to the Command Complete. */
+            return true;
+        }
+    }
+
+    if (!completion) {
+        queueEvent(evtBuf, size);
+        return true;
+    }
+    for (uint32_t i = 0; i < m_pendingCount; i++) {
+        RtlPendingCommand *pending = &m_pending[(m_pendingHead + i) % RTL_CMD_MAX_PENDING];
+        if (!pending->completed && pending->opcode == opcode) {
+            pending->completed = true;
+            pending->status = status;
+            m_stats.record(opcode, pending->submittedNs, status == 0, false);
+            if (status) {
+                RTL_TRACE_ERR(m_trace, RTL_TRACE_CMD_FAILED, opcode, status);
+                m_pipelineError = true;
+            }
+            while (m_pendingCount > 0 && m_pending[m_pendingHead].completed) {
+                m_pendingHead = (m_pendingHead + 1) % RTL_CMD_MAX_PENDING;
+                m_pendingCount--;
+            }
+            return true;
+        }
+    }
+    RTL_TRACE_INF(m_trace, RTL_TRACE_CMD_UNEXPECTED, opcode, status);
+    return true;
+}
+
+void RtlCore::
+queueEvent(const uint8_t *event, uint32_t len)
+{
+    RtlQueuedEvent *slot;
+
+    if (m_eventCount == RTL_EVENT_QUEUE_LEN) {
+        RTL_TRACE_INF(m_trace, RTL_TRACE_EVENT_DROPPED, m_events[m_eventHead].data[0]);
+        m_eventHead = (m_eventHead + 1) % RTL_EVENT_QUEUE_LEN;
+        m_eventCount--;
+        m_eventsDropped++;
+    }
+    slot = &m_events[(m_eventHead + m_eventCount++) % RTL_EVENT_QUEUE_LEN];
+    slot->len = len;
+    memcpy(slot->data, event, len);
+    RTL_TRACE_DBG(m_trace, RTL_TRACE_EVENT_QUEUED, event[0], len, m_eventCount);
+}
+
+/* Remove the oldest queued event with code event, keeping the others in order. */
+bool RtlCore::
+takeQueuedEvent(uint8_t event, void *buf, uint32_t bufSize, uint32_t *size)
+{
+    for (uint32_t i = 0; i < m_eventCount; i++) {
+        RtlQueuedEvent *slot = &m_events[(m_eventHead + i) % RTL_EVENT_QUEUE_LEN];
+        uint32_t len = slot->len < bufSize ? slot->len : bufSize;
+        if (slot->data[0] != event) {
+            continue;
+        }
+        if (buf) {
+            memcpy(buf, slot->data, len);
+        }
+        if (size) {
+            *size = len;
+        }
+        for (uint32_t j = i; j + 1 < m_eventCount; j++) {
+            m_events[(m_eventHead + j) % RTL_EVENT_QUEUE_LEN] = m_events[(m_eventHead + j + 1) % RTL_EVENT_QUEUE_LEN];
+        }
+        m_eventCount--;
+        return true;
+    }
+    return false;
+}
+
+bool RtlCore::
+registerEventHandler(uint8_t event, RtlEventHandler handler, void *context)
+{
+    RtlEventHandlerSlot *slot = NULL;
+
+    for (int i = 0; i < RTL_EVENT_MAX_HANDLERS; i++) {
+        if (m_handlers[i].handler && m_handlers[i].event == event) {
+            slot = &m_handlers[i];
+            break;
+        }
+        if (!m_handlers[i].handler && !slot) {
+            slot = &m_handlers[i];
+        }
+    }
+    if (!slot) {
+        return false;
+    }
+    slot->event = event;
+    slot->handler = handler;
+    slot->context = context;
+    return true;
+}
+
+void RtlCore::
+unregisterEventHandler(uint8_t event)
+{
+    for (int i = 0; i < RTL_EVENT_MAX_HANDLERS; i++) {
+        if (m_handlers[i].handler && m_handlers[i].event == event) {
+            memset(&m_handlers[i], 0, sizeof(m_handlers[i]));
+        }
+    }
+}
+
+void RtlCore::
+deliverEvents()
+{
+    RtlQueuedEvent event;
+
+    /* Handlers may send commands, which deliver again on the way out. */
+    if (m_delivering) {
+        return;
+    }
+    m_delivering = true;
+    for (int i = 0; i < RTL_EVENT_MAX_HANDLERS; i++) {
+        RtlEventHandlerSlot slot = m_handlers[i];
+        if (!slot.handler) {
+            continue;
+        }
+        while (takeQueuedEvent(slot.event, event.data, sizeof(event.data), &event.len)) {
+            slot.handler(slot.context, event.data, event.len);
+        }
+    }
+    m_delivering = false;
+}
+
+bool RtlCore::
+waitForEvent(uint8_t event, void *buf, uint32_t bufSize, uint32_t *size, int timeout)
+{
+    m_lastReadError = kIOReturnSuccess;
+    if (takeQueuedEvent(event, buf, bufSize, size)) {
+        return true;
+    }
+    if (!waitFor(event, HCI_OP_NOP, buf, bufSize, size, timeout)) {
+        return false;
+    }
+    deliverEvents();
+    return true;
+}
+
+bool RtlCore::
+waitCommandComplete(uint16_t opcode, void *resp, uint32_t respSize, uint32_t *respLen, int timeout)
+{
+    uint8_t evtBuf[HCI_MAX_EVENT_SIZE];
+    HciResponse *evt = (HciResponse *)evtBuf;
+    uint32_t size = 0;
+    uint32_t dataLen;
+
+    if (!waitFor(HCI_EV_CMD_COMPLETE, opcode, evtBuf, sizeof(evtBuf), &size, timeout)) {
+        return false;
+    }
+    if (evtBuf[0] == HCI_EV_CMD_STATUS) {
+        XYLog("%s 0x%04x failed, status 0x%02x\n", __FUNCTION__, opcode, evtBuf[HCI_EVENT_HDR_SIZE]);
+        return false;
+    }
+    dataLen = size - sizeof(HciResponse);
+    if (resp) {
+        memcpy(resp, evt->data, dataLen < respSize ? dataLen : respSize);
+    }
+    if (respLen) {
+        *respLen = dataLen;
+    }
+    return true;
+}
+
+bool RtlCore::
+readLocalVersion(hci_rp_read_local_version *version)
+{
+    uint32_t size = 0;
+
+    if (!sendCommand(HCI_OP_READ_LOCAL_VERSION, NULL, 0, version, sizeof(*version), &size, HCI_INIT_TIMEOUT)) {
+        XYLog("Failed to read local version\n");
+        return false;
+    }
+    if (size != sizeof(*version) || version->status) {
+        XYLog("Local version response invalid, len %d status 0x%02x\n", size, version->status);
+        return false;
+    }
+    XYLog("HCI rev 0x%04x LMP subver 0x%04x HCI ver %d\n", OSSwapLittleToHostInt16(version->hci_rev),
+          OSSwapLittleToHostInt16(version->lmp_subver), version->hci_ver);
+    return true;
+}
+
+bool RtlCore::
+readRomVersion(uint8_t *version)
+{
+    rtl_rom_version_evt evt;
+    uint32_t size = 0;
+
+    XYLog("%s\n", __PRETTY_FUNCTION__);
+
+    if (!sendCommand(HCI_OP_RTL_READ_ROM_VERSION, NULL, 0, &evt, sizeof(evt), &size, HCI_INIT_TIMEOUT)) {
+        XYLog("Failed to read ROM version\n");
+        return false;
+    }
+
+    if (size != sizeof(rtl_rom_version_evt)) {
+        XYLog("ROM version event length mismatch\n");
+        return false;
+    }
+
+    if (evt.status != 0) {
+        XYLog("Failed to read ROM version, status: 0x%02x\n", evt.status);
+        return false;
+    }
+
+    *version = evt.version;
+    XYLog("Realtek ROM version: 0x%02x\n", *version);
+
+    return true;
+}
+
+/*
+ * Walk the v1 extension section backwards until the instruction carrying
+ * the project ID is found. tail holds the last len bytes of the image and
+ * the walk must not go below index floor.
+ */
+static int
+rtlFindProjectId(const uint8_t *tail, uint32_t len, uint32_t floor)
+{
+    int32_t pos = (int32_t)len - (int32_t)sizeof(rtlExtensionSig);
+
+    if (pos < 0 || memcmp(tail + pos, rtlExtensionSig, sizeof(rtlExtensionSig)) != 0) {
+        XYLog("Extension section signature mismatch\n");
+        return -1;
+    }
+    while (pos >= (int32_t)floor + 3) {
+        uint8_t opcode = tail[--pos];
+        uint8_t length = tail[--pos];
+        uint8_t data = tail[--pos];
+        if (opcode == 0xff) {
+            break;
+        }
+        if (length == 0) {
+            XYLog("Found extension instruction with length 0\n");
+            return -1;
+        }
+        if (opcode == 0 && length == 1) {
+            return data;
+        }
+        pos -= length;
+    }
+    XYLog("Failed to find project ID instruction\n");
+    return -1;
+}
+
+/*
+ * Look up rom_version in the v1 chip ID / length / offset tables, which
+ * start right after the epatch header.
+ */
+static bool
+rtlFindPatchV1(const uint8_t *tables, uint16_t num_patches, uint8_t rom_version, uint32_t *offset, uint16_t *length)
+{
+    const uint8_t *chip_id_base = tables;
+    const uint8_t *patch_length_base = chip_id_base + (sizeof(uint16_t) * num_patches);
+    const uint8_t *patch_offset_base = patch_length_base + (sizeof(uint16_t) * num_patches);
+
+    for (int i = 0; i < num_patches; i++) {
+        uint16_t chip_id = OSReadLittleInt16(chip_id_base, i * sizeof(uint16_t));
+        if (chip_id == rom_version + 1) {
+            *length = OSReadLittleInt16(patch_length_base, i * sizeof(uint16_t));
+            *offset = OSReadLittleInt32(patch_offset_base, i * sizeof(uint32_t));
+            return *offset != 0 && *length >= sizeof(uint32_t);
+        }
+    }
+    return false;
+}
+
+bool RtlCore::
+getFWDescByName(const char *name, RtlFwData *firmware)
+{
+    const FwDesc *desc = findFWDesc(name);
+    if (!desc) {
+        return false;
+    }
+    /* Uncompressed blobs are used in place. */
+    if (desc->codec == FW_CODEC_NONE) {
+        if (!RtlFwStream::verify(desc, desc->var, (uint32_t)desc->size)) {
+            return false;
+        }
+        firmware->bytes = desc->var;
+        firmware->length = (uint32_t)desc->size;
+        firmware->alloc = NULL;
+        firmware->allocSize = 0;
+        return true;
+    }
+    uint32_t destLen = (uint32_t)desc->uncompressed_size;
+    uint8_t *bytes = (uint8_t *)IOMalloc(destLen);
+    if (!bytes) {
+        return false;
+    }
+    if (!RtlFwStream::decode(desc, bytes, destLen)) {
+        XYLog("Failed to uncompress %s\n", name);
+        IOFree(bytes, destLen);
+        return false;
+    }
+    firmware->bytes = bytes;
+    firmware->length = destLen;
+    firmware->alloc = bytes;
+    firmware->allocSize = destLen;
+    return true;
+}
+
+bool RtlCore::
+parseFirmwareV2(RtlFwData *firmware, uint8_t rom_version, RtlFwPatch *patch)
+{
+    RtlEpatchV2Iterator iter;
+    RtlSubsection subsec;
+
+    if (!iter.init(firmware->bytes, firmware->length)) {
+        XYLog("Invalid V2 firmware header\n");
+        return false;
+    }
+    patch->numSegments = 0;
+    patch->length = 0;
+    patch->tailLength = 0;
+
+    while (iter.next(&subsec)) {
+        if (subsec.eco != rom_version + 1) {
+            continue;
+        }
+        /* key_id is not read from the controller yet, so as in btrtl with
+         * key_id 0 the security headers are left out.
+         */
+        if (subsec.opcode == RTL_PATCH_SECURITY_HEADER) {
+            continue;
+        }
+        if (patch->numSegments == RTL_PATCH_MAX_SEGMENTS) {
+            XYLog("Too many patch subsections for ROM version 0x%02x\n", rom_version);
+            return false;
+        }
+        /* Keep the segments ordered by priority; as in btrtl a subsection
+         * goes in front of those with the same priority.
+         */
+        uint32_t pos = patch->numSegments;
+        while (pos > 0 && patch->segments[pos - 1].prio >= subsec.prio) {
+            patch->segments[pos] = patch->segments[pos - 1];
+            pos--;
+        }
+        patch->segments[pos].bytes = subsec.data;
+        patch->segments[pos].length = subsec.length;
+        patch->segments[pos].prio = subsec.prio;
+        patch->numSegments++;
+        patch->length += subsec.length;
+        RTL_TRACE_DBG(m_trace, RTL_TRACE_V2_SUBSECTION, subsec.opcode, subsec.eco, subsec.prio, subsec.length);
+    }
+    if (iter.truncated()) {
+        XYLog("V2 firmware is truncated\n");
+        return false;
+    }
+    if (patch->length == 0) {
+        XYLog("No V2 patch for ROM version 0x%02x\n", rom_version);
+        return false;
+    }
+
+    /* The segments point into the image, so the patch takes it over. */
+    patch->storage = *firmware;
+    memset(firmware, 0, sizeof(*firmware));
+    return true;
+}
+
+bool RtlCore::
+parseFirmware(RtlFwData *firmware, uint8_t rom_version, int project_id, RtlFwPatch *patch)
+{
+    const uint8_t *fw_ptr = firmware->bytes;
+    uint32_t fw_len = firmware->length;
+
+    XYLog("%s\n", __PRETTY_FUNCTION__);
+
+    if (fw_len <= 8) {
+        XYLog("Firmware file is too short\n");
+        return false;
+    }
+
+    // Version 1 Firmware Format
+    if (memcmp(fw_ptr, RTL_EPATCH_SIGNATURE, sizeof(RTL_EPATCH_SIGNATURE) - 1) == 0) {
+        XYLog("Found V1 firmware signature\n");
+
+        if (fw_len < sizeof(rtl_epatch_header) + sizeof(rtlExtensionSig) + 3) {
+            XYLog("Firmware file is too short\n");
+            return false;
+        }
+
+        int fw_project_id = rtlFindProjectId(fw_ptr, fw_len, sizeof(rtl_epatch_header));
+        if (fw_project_id < 0) {
+            return false;
+        }
+        if (project_id >= 0 && fw_project_id != project_id) {
+            XYLog("Project ID mismatch: firmware %d, expected %d\n", fw_project_id, project_id);
+            return false;
+        }
+
+        const rtl_epatch_header *header = (const rtl_epatch_header *)fw_ptr;
+        uint16_t num_patches = OSSwapLittleToHostInt16(header->num_patches);
+        uint32_t fw_version = OSSwapLittleToHostInt32(header->fw_version);
+
+        XYLog("FW version: 0x%08x, patches: %d, project ID: %d\n", fw_version, num_patches, fw_project_id);
+
+        if (fw_len < sizeof(rtl_epatch_header) + 8 * (uint32_t)num_patches) {
+            XYLog("Firmware file is too short for %d patches\n", num_patches);
+            return false;
+        }
+
+        uint32_t patch_offset = 0;
+        uint16_t patch_length = 0;
+
+        if (!rtlFindPatchV1(fw_ptr + sizeof(rtl_epatch_header), num_patches, rom_version, &patch_offset, &patch_length)) {
+            XYLog("Failed to find patch for ROM version 0x%02x\n", rom_version);
+            return false;
+        }
+
+        XYLog("Found patch for ROM version 0x%02x at offset 0x%x with length %d\n", rom_version, patch_offset, patch_length);
+
+        if (fw_len < patch_offset + patch_length) {
+            XYLog("Firmware file is too short for the patch\n");
+            return false;
+        }
+
+        /* The patch is a view into the image; its last four bytes are
+         * replaced with fw_version through the tail, as the image may be
+         * read-only.
+         */
+        patch->segments[0].bytes = fw_ptr + patch_offset;
+        patch->segments[0].length = patch_length - sizeof(uint32_t);
+        patch->segments[0].prio = 0;
+        patch->numSegments = 1;
+        OSWriteLittleInt32(patch->tail, 0, fw_version);
+        patch->tailLength = sizeof(uint32_t);
+        patch->length = patch_length;
+        patch->storage = *firmware;
+        memset(firmware, 0, sizeof(*firmware));
+        return true;
+    }
+    // Version 2 Firmware Format
+    else if (memcmp(fw_ptr, RTL_EPATCH_SIGNATURE_V2, sizeof(RTL_EPATCH_SIGNATURE_V2) - 1) == 0) {
+        XYLog("Found V2 firmware signature\n");
+        return parseFirmwareV2(firmware, rom_version, patch);
+    }
+    else {
+        XYLog("Unknown firmware signature\n");
+        return false;
+    }
+}
+
+bool RtlCore::
+loadPatchV1(RtlFwStream *stream, const rtl_epatch_header *header, uint8_t rom_version, int project_id, RtlFwPatch *patch)
+{
+    uint16_t num_patches = OSSwapLittleToHostInt16(header->num_patches);
+    uint32_t fw_version = OSSwapLittleToHostInt32(header->fw_version);
+    uint32_t tables_len = 8 * (uint32_t)num_patches;
+    uint32_t fw_len = stream->size();
+    uint32_t patch_offset = 0;
+    uint16_t patch_length = 0;
+    uint8_t tail[RTL_EXT_WINDOW];
+    uint32_t tail_start;
+    uint32_t floor;
+    int fw_project_id;
+    uint8_t *tables;
+    uint8_t *bytes;
+    bool found;
+
+    if (fw_len < sizeof(rtl_epatch_header) + tables_len + sizeof(rtlExtensionSig) + 3) {
+        XYLog("Firmware file is too short for %d patches\n", num_patches);
+        return false;
+    }
+    tables = (uint8_t *)IOMalloc(tables_len);
+    if (!tables) {
+        return false;
+    }
+    found = stream->read(tables, tables_len) &&
+            rtlFindPatchV1(tables, num_patches, rom_version, &patch_offset, &patch_length);
+    IOFree(tables, tables_len);
+    if (!found) {
+        XYLog("Failed to find patch for ROM version 0x%02x\n", rom_version);
+        return false;
+    }
+    if (patch_offset < stream->offset() || fw_len < patch_offset + patch_length) {
+        XYLog("Patch for ROM version 0x%02x out of range: offset 0x%x length %d\n", rom_version, patch_offset, patch_length);
+        return false;
+    }
+
+    /* Inflate the patch straight into the buffer that will be downloaded. */
+    bytes = (uint8_t *)IOMalloc(patch_length);
+    if (!bytes) {
+        return false;
+    }
+    if (!stream->seek(patch_offset) || !stream->read(bytes, patch_length)) {
+        IOFree(bytes, patch_length);
+        return false;
+    }
+
+    tail_start = fw_len - RTL_EXT_WINDOW;
+    if (fw_len < RTL_EXT_WINDOW || tail_start < stream->offset()) {
+        tail_start = stream->offset();
+    }
+    floor = tail_start < sizeof(rtl_epatch_header) ? (uint32_t)sizeof(rtl_epatch_header) - tail_start : 0;
+    if (!stream->seek(tail_start) || !stream->read(tail, fw_len - tail_start) ||
+        (fw_project_id = rtlFindProjectId(tail, fw_len - tail_start, floor)) < 0) {
+        IOFree(bytes, patch_length);
+        return false;
+    }
+    if (project_id >= 0 && fw_project_id != project_id) {
+        XYLog("Project ID mismatch: firmware %d, expected %d\n", fw_project_id, project_id);
+        IOFree(bytes, patch_length);
+        return false;
+    }
+
+    XYLog("FW version: 0x%08x, project ID: %d, patch for ROM version 0x%02x: offset 0x%x length %d\n",
+          fw_version, fw_project_id, rom_version, patch_offset, patch_length);
+
+    /* The buffer is ours, so fw_version goes directly over the last four bytes. */
+    OSWriteLittleInt32(bytes, patch_length - sizeof(uint32_t), fw_version);
+    patch->storage.bytes = bytes;
+    patch->storage.length = patch_length;
+    patch->storage.alloc = bytes;
+    patch->storage.allocSize = patch_length;
+    patch->segments[0].bytes = bytes;
+    patch->segments[0].length = patch_length;
+    patch->segments[0].prio = 0;
+    patch->numSegments = 1;
+    patch->tailLength = 0;
+    patch->length = patch_length;
+    return true;
+}
+
+bool RtlCore::
+loadIndexedPatch(const FwPatchIndex *entry, RtlFwPatch *patch)
+{
+    const FwDesc *desc = &entry->patch;
+    uint32_t length = (uint32_t)desc->uncompressed_size;
+    uint8_t *bytes;
+
+    memset(patch, 0, sizeof(*patch));
+    if (length == 0) {
+        return false;
+    }
+    if (desc->codec == FW_CODEC_NONE) {
+        if (!RtlFwStream::verify(desc, desc->var, length)) {
+            return false;
+        }
+        patch->segments[0].bytes = desc->var;
+    } else {
+        bytes = (uint8_t *)IOMalloc(length);
+        if (!bytes) {
+            return false;
+        }
+        if (!RtlFwStream::decode(desc, bytes, length)) {
+            XYLog("Failed to decode %s patch for ROM version 0x%02x\n", desc->name, entry->rom_version);
+            IOFree(bytes, length);
+            return false;
+        }
+        patch->storage.bytes = bytes;
+        patch->storage.length = length;
+        patch->storage.alloc = bytes;
+        patch->storage.allocSize = length;
+        patch->segments[0].bytes = bytes;
+    }
+    patch->segments[0].length = length;
+    patch->numSegments = 1;
+    patch->length = length;
+    return true;
+}
+
+bool RtlCore::
+loadPatch(const char *name, uint8_t rom_version, int project_id, RtlFwPatch *patch)
+{
+    const FwDesc *desc = findFWDesc(name);
+    RtlFwStream stream;
+    RtlFwData firmware;
+    uint8_t head[sizeof(rtl_epatch_header)];
+    uint8_t *bytes;
+    uint32_t size;
+    bool ret;
+
+    if (!desc) {
+        XYLog("Embedded firmware %s not found\n", name);
+        return false;
+    }
+    memset(patch, 0, sizeof(*patch));
+
+    /* Embedded rodata needs no materialization at all. */
+    if (desc->codec == FW_CODEC_NONE) {
+        if (!getFWDescByName(name, &firmware)) {
+            return false;
+        }
+        return parseFirmware(&firmware, rom_version, project_id, patch);
+    }
+
+    if (!stream.open(desc) || !stream.read(head, sizeof(head))) {
+        XYLog("Failed to read %s\n", name);
+        return false;
+    }
+    if (memcmp(head, RTL_EPATCH_SIGNATURE, sizeof(RTL_EPATCH_SIGNATURE) - 1) == 0) {
+        return loadPatchV1(&stream, (const rtl_epatch_header *)head, rom_version, project_id, patch);
+    }
+
+    /* v2 patches are scattered over the image, so it is inflated once, in
+     * full, and the patch points into it.
+     */
+    size = stream.size();
+    bytes = (uint8_t *)IOMalloc(size);
+    if (!bytes) {
+        return false;
+    }
+    memcpy(bytes, head, sizeof(head));
+    if (!stream.read(bytes + sizeof(head), size - sizeof(head))) {
+        IOFree(bytes, size);
+        return false;
+    }
+    firmware.bytes = bytes;
+    firmware.length = size;
+    firmware.alloc = bytes;
+    firmware.allocSize = size;
+    ret = parseFirmware(&firmware, rom_version, project_id, patch);
+    releaseFwData(&firmware);
+    return ret;
+}
+
+/* Cursor over the segments and tail of a resident patch. */
+typedef struct {
+    const RtlFwPatch    *patch;
+    uint32_t            seg;
+    uint32_t            segOff;
+} RtlPatchCursor;
+
+/* Copy len bytes from the patch at the cursor and advance it. */
+static bool
+rtlGatherPatch(void *context, uint8_t *dst, uint32_t len)
+{
+    RtlPatchCursor *cursor = (RtlPatchCursor *)context;
+    const RtlFwPatch *patch = cursor->patch;
+
+    while (len > 0) {
+        const uint8_t *src = patch->tail;
+        uint32_t avail = patch->tailLength;
+        uint32_t chunk;
+
+        if (cursor->seg < patch->numSegments) {
+            src = patch->segments[cursor->seg].bytes;
+            avail = patch->segments[cursor->seg].length;
+        }
+        chunk = avail - cursor->segOff;
+        if (chunk > len) {
+            chunk = len;
+        }
+        memcpy(dst, src + cursor->segOff, chunk);
+        dst += chunk;
+        len -= chunk;
+        cursor->segOff += chunk;
+        if (cursor->segOff == avail) {
+            cursor->seg++;
+            cursor->segOff = 0;
+        }
+    }
+    return true;
+}
+
+static bool
+rtlReadStream(void *context, uint8_t *dst, uint32_t len)
+{
+    return ((RtlFwStream *)context)->read(dst, len);
+}
+
+bool RtlCore::
+downloadFirmware(const RtlFwPatch *patch)
+{
+    RtlPatchCursor cursor = { patch, 0, 0 };
+
+    XYLog("%s: patch_len %d segments %d\n", __PRETTY_FUNCTION__, patch->length, patch->numSegments);
+    return downloadFragments(rtlGatherPatch, &cursor, patch->length);
+}
+
+bool RtlCore::
+downloadFirmware(RtlFwStream *stream)
+{
+    XYLog("%s: streaming patch_len %d\n", __PRETTY_FUNCTION__, stream->size() - stream->offset());
+    return downloadFragments(rtlReadStream, stream, stream->size() - stream->offset());
+}
+
+bool RtlCore::
+downloadFragments(RtlFragmentSource source, void *context, uint32_t patch_len)
+{
+    uint32_t frag_num = patch_len / RTL_FRAG_LEN + 1;
+    uint8_t buf[HCI_COMMAND_HDR_SIZE + sizeof(rtl_download_cmd)];
+    HciCommandHdr *cmd = (HciCommandHdr *)buf;
+    rtl_download_cmd *dl = (rtl_download_cmd *)cmd->data;
+
+    if (!flushCommands(HCI_INIT_TIMEOUT)) {
+        return false;
+    }
+
+    /* Fragment i is produced while fragment i - 1 is still in flight; the
+     * command engine only waits for a completion when it runs out of
+     * credits, so producing the patch overlaps the USB round trips.
+     */
+    for (uint32_t i = 0; i < frag_num; i++) {
+        uint32_t frag_len = RTL_FRAG_LEN;
+        uint32_t j = i;
+        if (j > 0x7f) {
+            j = (j & 0x7f) + 1;
+        }
+        dl->index = j;
+        if (i == frag_num - 1) {
+            dl->index |= 0x80; // Set the final fragment flag
+            frag_len = patch_len % RTL_FRAG_LEN;
+        }
+        if (!source(context, dl->data, frag_len)) {
+            XYLog("Failed to produce firmware fragment %d\n", i);
+            flushCommands(HCI_INIT_TIMEOUT);
+            return false;
+        }
+        cmd->opcode = OSSwapHostToLittleInt16(HCI_OP_RTL_DOWNLOAD_FW);
+        cmd->len = frag_len + 1;
+        RTL_TRACE_DBG(m_trace, RTL_TRACE_FRAGMENT, i, dl->index, frag_len);
+        if (!queueCommand(cmd, HCI_INIT_TIMEOUT)) {
+            XYLog("Failed to send firmware fragment index %d\n", i);
+            flushCommands(HCI_INIT_TIMEOUT);
+            return false;
+        }
+    }
+    if (!flushCommands(HCI_INIT_TIMEOUT)) {
+        XYLog("Firmware fragment rejected\n");
+        return false;
+    }
+
+    XYLog("Firmware download complete.\n");
+    return true;
+}
+
+bool RtlCore::
+loadDDCConfig(const char *ddcFileName)
+{
+    RtlFwData ddc;
+    uint32_t offset = 0;
+
+    if (!getFWDescByName(ddcFileName, &ddc)) {
+        XYLog("DDC file not found: %s\n", ddcFileName);
+        return false;
+    }
+
+    XYLog("Load DDC config: %s %d\n", ddcFileName, ddc.length);
+
+    /* DDC file contains one or more DDC structure which has
+     * Length (1 byte), DDC ID (2 bytes), and DDC value (Length - 2).
+     */
+    while (offset < ddc.length) {
+        uint8_t cmd_plen = ddc.bytes[offset] + sizeof(uint8_t);
+
+        if (offset + cmd_plen > ddc.length) {
+            XYLog("Truncated DDC entry at offset %d\n", offset);
+            releaseFwData(&ddc);
+            return false;
+        }
+        if (!queueCommand(HCI_OP_RTL_WRITE_DDC, ddc.bytes + offset, cmd_plen, HCI_INIT_TIMEOUT)) {
+            XYLog("Failed to send Realtek_Write_DDC\n");
+            flushCommands(HCI_INIT_TIMEOUT);
+            releaseFwData(&ddc);
+            return false;
+        }
+
+        offset += cmd_plen;
+    }
+    releaseFwData(&ddc);
+    if (!flushCommands(HCI_INIT_TIMEOUT)) {
+        XYLog("Realtek_Write_DDC failed\n");
+        m_trace.dump(64);
+        return false;
+    }
+
+    XYLog("Load DDC config done\n");
+    return true;
+}
+
+bool RtlCore::
+setupFirmware()
+{
+    hci_rp_read_local_version ver;
+    uint8_t rom_version = 0;
+    uint16_t lmp_subversion = 0;
+    uint16_t hci_rev;
+    const RtlChipId *id;
+    const char *firmware = NULL;
+    uint32_t quirks = 0;
+    uint32_t running;
+    const FwPatchIndex *index;
+    RtlFwStream stream;
+    RtlFwPatch fw_patch;
+    RtlPatchCache *cache;
+    RtlPatchCacheEntry *cached;
+    RtlPatchCacheStats stats;
+    uint64_t start = RtlMonotonicNs();
+    uint64_t opened, downloaded;
+    bool hit = false;
+    bool ret;
+
+    XYLog("%s\n", __PRETTY_FUNCTION__);
+
+    // 1. Identify the chip from its local version alone
+    if (!readLocalVersion(&ver)) {
+        return false;
+    }
+    lmp_subversion = OSSwapLittleToHostInt16(ver.lmp_subver);
+    hci_rev = OSSwapLittleToHostInt16(ver.hci_rev);
+    id = rtlIdentifyChip(lmp_subversion, hci_rev, ver.hci_ver, m_pTransport->bus());
+    if (id) {
+        firmware = id->firmware;
+        quirks = id->quirks;
+        if (m_pChip && strcmp(m_pChip->name, id->name) != 0) {
+            XYLog("USB IDs say %s, controller identifies as %s\n", m_pChip->name, id->name);
+        }
+    } else if (m_pChip) {
+        // Also the case of a controller that is already patched
+        firmware = m_pChip->firmware;
+        quirks = m_pChip->quirks;
+    }
+
+    // 2. Read its ROM version, unless the chip has none
+    if (!(quirks & FW_CHIP_NO_ROM_VERSION) && !readRomVersion(&rom_version)) {
+        return false;
+    }
+
+    // 3. A controller still running our patch, e.g. after a soft reboot
+    //    or a driver reload, is ready as it is
+    running = ((uint32_t)hci_rev << 16) | lmp_subversion;
+    index = findFWPatchByVersion(running, rom_version);
+    if (index) {
+        XYLog("Controller already runs %s patch 0x%08x for ROM version 0x%02x, skipping download (%llu us)\n",
+              index->patch.name, running, rom_version, (unsigned long long)((RtlMonotonicNs() - start) / 1000));
+        return true;
+    }
+
+    // 4. Look the patch up in the build-time index
+    index = firmware ? findFWPatch(firmware, rom_version) : NULL;
+    if (!index) {
+        XYLog("Unsupported chip: lmp_subversion 0x%04x hci_rev 0x%04x hci_ver %d ROM version 0x%02x\n",
+              lmp_subversion, hci_rev, ver.hci_ver, rom_version);
+        return false;
+    }
+
+    XYLog("Chip %s, selected firmware: %s, %u byte config\n", id ? id->name : m_pChip->name, index->patch.name,
+          index->config_size);
+    if ((quirks & FW_CHIP_CONFIG_NEEDED) && !index->config_size) {
+        XYLog("No config embedded for %s, the controller may come up misconfigured\n", index->patch.name);
+    }
+
+    // 5. Download the patch. Raw records are read in place; encoded ones
+    //    come from the shared cache, or are decoded once into the buffer
+    //    that is then handed to the cache for the next controller. Only a
+    //    zlib patch too large to cache is inflated while it is sent.
+    cache = RtlPatchCache::shared();
+    opened = RtlMonotonicNs();
+    if (index->patch.codec == FW_CODEC_NONE) {
+        if (!loadIndexedPatch(index, &fw_patch)) {
+            return false;
+        }
+        ret = downloadFirmware(&fw_patch);
+        releaseFwPatch(&fw_patch);
+    } else if ((cached = cache->acquire(index->patch.name, rom_version, index->project_id))) {
+        ret = downloadFirmware(&cached->patch);
+        cache->release(cached);
+        hit = true;
+    } else if (index->patch.codec == FW_CODEC_ZLIB && index->patch.uncompressed_size > RTL_PATCH_CACHE_CAPACITY) {
+        if (!stream.open(&index->patch)) {
+            XYLog("Failed to open firmware patch from %s\n", index->patch.name);
+            return false;
+        }
+        ret = downloadFirmware(&stream);
+    } else {
+        if (!loadIndexedPatch(index, &fw_patch)) {
+            return false;
+        }
+        ret = downloadFirmware(&fw_patch);
+        if (ret && (cached = cache->insert(index->patch.name, rom_version, index->project_id, &fw_patch))) {
+            cache->release(cached);
+        }
+        releaseFwPatch(&fw_patch);
+    }
+    if (!ret) {
+        XYLog("Failed to download firmware patch\n");
+        m_trace.dump(64);
+        return false;
+    }
+    downloaded = RtlMonotonicNs();
+
+    cache->getStats(&stats);
+    XYLog("Patch cache %s: %d hits, %d misses, %d entries, %d bytes\n", hit ? "hit" : "miss",
+          stats.hits, stats.misses, stats.entries, stats.bytes);
+    XYLog("Firmware setup completed successfully! identify %llu us, download %llu us\n",
+          (unsigned long long)((opened - start) / 1000), (unsigned long long)((downloaded - opened) / 1000));
+    return true;
+}
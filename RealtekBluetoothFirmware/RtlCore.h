@@ -0,0 +1,418 @@
+//
+//  RtlCore.h
+//  RtlBluetoothFirmware
+//
+//  Portable part of the Realtek firmware loader: embedded firmware lookup,
+//  epatch parsing, DDC config and patch download. Everything goes through
+//  RtlTransport, so this builds both into the kext and on a plain host.
+//
+
+#ifndef RtlCore_h
+#define RtlCore_h
+
+#include "RtlPlatform.h"
+#include "RtlTransport.h"
+#include "Hci.h"
+#include "linux.h"
+#include "RtlFwStream.h"
+#include "RtlHciStats.h"
+#include "RtlTrace.h"
+#include "RtlSnoop.h"
+
+#define HCI_OP_READ_LOCAL_VERSION 0x1001
+#define HCI_OP_RTL_READ_ROM_VERSION 0xfc6d
+#define HCI_OP_RTL_DOWNLOAD_FW 0xfc20
+#define HCI_OP_RTL_READ_REG 0xfc61
+#define HCI_OP_RTL_WRITE_DDC 0xfc8b
+#define HCI_OP_RTL_COREDUMP 0xfcff
+
+#define RTL_FRAG_LEN 252
+
+#define CMD_BUF_MAX_SIZE    256
+
+#define HCI_MAX_EVENT_SIZE  (HCI_EVENT_HDR_SIZE + 255)
+
+// These structs are from linux/drivers/bluetooth/btrtl.h
+struct rtl_rom_version_evt {
+	__u8 status;
+	__u8 version;
+} __packed;
+
+struct rtl_download_cmd {
+	__u8 index;
+	__u8 data[RTL_FRAG_LEN];
+} __packed;
+
+struct rtl_download_response {
+	__u8 status;
+	__u8 index;
+} __packed;
+
+struct hci_rp_read_local_version {
+	__u8   status;
+	__u8   hci_ver;
+	__le16 hci_rev;
+	__u8   lmp_ver;
+	__le16 manufacturer;
+	__le16 lmp_subver;
+} __packed;
+
+#define RTL_EPATCH_SIGNATURE "Realtech"
+#define RTL_EPATCH_SIGNATURE_V2 "RTBTCore"
+
+struct rtl_epatch_header {
+	__u8 signature[8];
+	__le32 fw_version;
+	__le16 num_patches;
+} __packed;
+
+struct rtl_epatch_header_v2 {
+	__u8   signature[8];
+	__u8   fw_version[8];
+	__le32 num_sections;
+} __packed;
+
+struct rtl_section {
+	__le32 opcode;
+	__le32 len;
+	u8     data[];
+} __packed;
+
+struct rtl_section_hdr {
+	__le16 num;
+	__le16 reserved;
+} __packed;
+
+struct rtl_common_subsec {
+	u8     eco;
+	u8     prio;
+	u8     cb[2];
+	__le32 len;
+	u8     data[];
+} __packed;
+
+struct rtl_sec_hdr {
+	u8     eco;
+	u8     prio;
+	u8     key_id;
+	u8     reserved;
+	__le32 len;
+	u8     data[];
+} __packed;
+
+/*
+ * Header of rtl*_config.bin. generate_fw_data.py appends the config to the
+ * patch, so it is downloaded as part of the same record.
+ */
+#define RTL_CONFIG_MAGIC 0x8723ab55
+
+struct rtl_vendor_config {
+	__le32 signature;
+	__le16 total_len;
+	__u8 entry[];
+} __packed;
+
+#define RTL_PATCH_SNIPPETS          0x01
+#define RTL_PATCH_DUMMY_HEADER      0x02
+#define RTL_PATCH_SECURITY_HEADER   0x03
+
+struct FwPatchIndex;
+struct FwChip;
+
+#define RTL_CMD_MAX_PENDING 8
+
+/* A command sent through the pipeline that has not completed yet. */
+typedef struct {
+    uint16_t        opcode;
+    uint8_t         status;
+    bool            completed;
+    uint64_t        submittedNs;
+} RtlPendingCommand;
+
+#define RTL_EVENT_QUEUE_LEN     8
+#define RTL_EVENT_MAX_HANDLERS  4
+
+/* Called with a whole event, header included. */
+typedef void (*RtlEventHandler)(void *context, const uint8_t *event, uint32_t len);
+
+typedef struct {
+    uint8_t         event;
+    RtlEventHandler handler;
+    void            *context;
+} RtlEventHandlerSlot;
+
+typedef struct {
+    uint32_t        len;
+    uint8_t         data[HCI_MAX_EVENT_SIZE];
+} RtlQueuedEvent;
+
+/*
+ * The event a synchronous caller is blocked on. event 0 takes either a
+ * Command Complete or a Command Status; Command Complete/Status only match
+ * when they carry opcode.
+ */
+typedef struct {
+    bool            active;
+    bool            done;
+    uint8_t         event;
+    uint16_t        opcode;
+    uint8_t         *buf;
+    uint32_t        bufSize;
+    uint32_t        len;
+    uint8_t         status;     // of the matching completion
+} RtlEventWaiter;
+
+/* Produces the next len bytes of a patch being downloaded. */
+typedef bool (*RtlFragmentSource)(void *context, uint8_t *dst, uint32_t len);
+
+/*
+ * A firmware image. bytes either points at embedded rodata (alloc is NULL)
+ * or into the IOMalloc'd block alloc of allocSize bytes, which is owned.
+ */
+typedef struct {
+    const uint8_t   *bytes;
+    uint32_t        length;
+    void            *alloc;
+    uint32_t        allocSize;
+} RtlFwData;
+
+#define RTL_PATCH_MAX_SEGMENTS 16
+
+typedef struct {
+    const uint8_t   *bytes;
+    uint32_t        length;
+    uint8_t         prio;
+} RtlFwSegment;
+
+/*
+ * The patch selected for one controller: an ordered list of byte ranges
+ * that are downloaded back to back, followed by tailLength bytes of tail.
+ * The ranges point into storage, which the patch owns. The tail carries
+ * the v1 fw_version when storage is read-only and cannot be patched.
+ */
+typedef struct {
+    RtlFwData       storage;
+    RtlFwSegment    segments[RTL_PATCH_MAX_SEGMENTS];
+    uint32_t        numSegments;
+    uint32_t        length;
+    uint8_t         tail[4];
+    uint32_t        tailLength;
+} RtlFwPatch;
+
+/* One subsection of an RTBTCore (epatch v2) image, as laid out in the file. */
+typedef struct {
+    uint32_t        opcode;
+    uint8_t         eco;
+    uint8_t         prio;
+    uint8_t         keyId;
+    const uint8_t   *data;
+    uint32_t        length;
+} RtlSubsection;
+
+/*
+ * Walks the sections and subsections of an epatch v2 image in place,
+ * without allocating or copying.
+ */
+class RtlEpatchV2Iterator {
+public:
+    bool init(const uint8_t *fw, uint32_t len);
+
+    bool next(RtlSubsection *subsec);
+
+    /* True when iteration stopped on a malformed or truncated section. */
+    bool truncated() const { return m_truncated; }
+
+    const uint8_t *fwVersion() const { return m_pFwVersion; }
+
+private:
+    bool nextSection();
+
+private:
+    const uint8_t   *m_pFwVersion;
+    const uint8_t   *m_pCur;
+    const uint8_t   *m_pEnd;
+    const uint8_t   *m_pSectionCur;
+    const uint8_t   *m_pSectionEnd;
+    uint32_t        m_sectionsLeft;
+    uint32_t        m_subsecsLeft;
+    uint32_t        m_opcode;
+    bool            m_truncated;
+};
+
+class RtlCore {
+public:
+    RtlCore(RtlTransport *transport);
+
+    bool sendHCISync(HciCommandHdr *cmd, void *event, uint32_t eventBufSize, uint32_t *size, int timeout);
+
+    bool sendHCISyncEvent(HciCommandHdr *cmd, void *event, uint32_t eventBufSize, uint32_t *size, uint8_t syncEvent, int timeout);
+
+    bool bulkHCISync(HciCommandHdr *cmd, void *event, uint32_t eventBufSize, uint32_t *size, int timeout);
+
+    /*
+     * bulkHCISync without the copy: *event points at the response where it
+     * was read, in a transport buffer or, for a transport without pooled
+     * reads, the core's own, and stays there until releaseBulkEvent.
+     */
+    bool bulkHCIBorrow(HciCommandHdr *cmd, const void **event, uint32_t *size, int timeout);
+
+    void releaseBulkEvent(const void *event);
+
+    /*
+     * A bulk command built straight in a transport buffer: fill the one
+     * acquireBulkCommand returns and send it with submitBulkCommand, which
+     * works like bulkHCISync and gives the buffer back, or hand it back
+     * unsent with releaseBulkCommand. NULL when the transport has none
+     * free or none that holds capacity bytes; use bulkHCISync then.
+     */
+    HciCommandHdr *acquireBulkCommand(uint32_t capacity);
+
+    bool submitBulkCommand(HciCommandHdr *cmd, void *event, uint32_t eventBufSize, uint32_t *size, int timeout);
+
+    void releaseBulkCommand(HciCommandHdr *cmd);
+
+    /*
+     * Send a command and wait for its Command Complete. On success resp
+     * receives the return parameters (status byte first).
+     */
+    bool sendCommand(uint16_t opcode, const void *param, uint8_t plen, void *resp, uint32_t respSize, uint32_t *respLen, int timeout);
+
+    /*
+     * Pipelined commands. queueCommand sends as soon as the controller has
+     * a command credit (Num_HCI_Command_Packets of the last Command
+     * Complete/Status) instead of waiting for the previous completion.
+     * Completions are matched back to their commands by opcode, oldest
+     * first. flushCommands waits for all of them and fails if any command
+     * returned an error status. Synchronous commands flush first.
+     */
+    bool queueCommand(uint16_t opcode, const void *param, uint8_t plen, int timeout);
+
+    bool queueCommand(HciCommandHdr *cmd, int timeout);
+
+    bool flushCommands(int timeout);
+
+    /*
+     * Events that are not the completion of a command in flight (vendor
+     * events, Hardware Error, stray Command Status...) are queued instead
+     * of dropped. Queued events with a registered handler are handed to
+     * it once the current command finishes; the others stay queued, oldest
+     * dropped first, until waitForEvent picks them up.
+     */
+    bool registerEventHandler(uint8_t event, RtlEventHandler handler, void *context);
+
+    void unregisterEventHandler(uint8_t event);
+
+    /* Wait for an unsolicited event, taking it from the queue if it already arrived. */
+    bool waitForEvent(uint8_t event, void *buf, uint32_t bufSize, uint32_t *size, int timeout);
+
+    /* Why the last wait gave up, kIOReturnTimeout when nothing arrived in time. */
+    IOReturn lastReadError() const { return m_lastReadError; }
+
+    void deliverEvents();
+
+    bool readLocalVersion(hci_rp_read_local_version *version);
+
+    bool readRomVersion(uint8_t *version);
+
+    bool getFWDescByName(const char *name, RtlFwData *firmware);
+
+    /*
+     * Select the patch for rom_version. Nothing is copied: the patch takes
+     * over firmware and refers to it, leaving firmware empty.
+     */
+    bool parseFirmware(RtlFwData *firmware, uint8_t rom_version, int project_id, RtlFwPatch *patch);
+
+    /*
+     * Materialize only the patch for rom_version out of the embedded blob
+     * name. Compressed v1 images are inflated straight into the patch
+     * buffer; everything before and after it is streamed through a small
+     * scratch buffer.
+     */
+    bool loadPatch(const char *name, uint8_t rom_version, int project_id, RtlFwPatch *patch);
+
+    /*
+     * Same for a patch extracted at build time: only its own record is
+     * decoded, uncompressed records are used in place.
+     */
+    bool loadIndexedPatch(const FwPatchIndex *entry, RtlFwPatch *patch);
+
+    bool downloadFirmware(const RtlFwPatch *patch);
+
+    /*
+     * Download the rest of stream without materializing it: each fragment
+     * is inflated straight into the command buffer while the previous one
+     * is in flight, so only one fragment is ever resident.
+     */
+    bool downloadFirmware(RtlFwStream *stream);
+
+    bool loadDDCConfig(const char *ddcFileName);
+
+    /*
+     * The chip expected from the USB IDs, if known. It settles the ROM
+     * version read and is checked against what the controller reports.
+     */
+    void setChip(const FwChip *chip) { m_pChip = chip; }
+
+    bool setupFirmware();
+
+    /* Latency and error counters of every command sent through this core. */
+    RtlHciStats *stats() { return &m_stats; }
+
+    RtlTraceRing *trace() { return &m_trace; }
+
+    /* btsnoop capture of everything sent and received, off until started. */
+    RtlSnoop *snoop() { return &m_snoop; }
+
+    static void releaseFwData(RtlFwData *data);
+
+    static void releaseFwPatch(RtlFwPatch *patch);
+
+private:
+    bool submitCommand(HciCommandHdr *cmd, int timeout);
+
+    bool bulkExchange(HciCommandHdr *cmd, bool inPlace, const void **event, uint32_t *size, int timeout);
+
+    bool copyBulkEvent(bool ok, const void *bytes, uint32_t len, void *event, uint32_t eventBufSize, uint32_t *size);
+
+    IOReturn readBulkEvent(const void **event, uint32_t *size, int timeout);
+
+    bool waitFor(uint8_t event, uint16_t opcode, void *buf, uint32_t bufSize, uint32_t *size, int timeout);
+
+    bool waitCommandComplete(uint16_t opcode, void *resp, uint32_t respSize, uint32_t *respLen, int timeout);
+
+    bool dispatchEvent(int timeout);
+
+    void recordCommand(uint16_t opcode, uint64_t startNs, bool ok);
+
+    void queueEvent(const uint8_t *event, uint32_t len);
+
+    bool takeQueuedEvent(uint8_t event, void *buf, uint32_t bufSize, uint32_t *size);
+
+    bool downloadFragments(RtlFragmentSource source, void *context, uint32_t patch_len);
+
+    bool parseFirmwareV2(RtlFwData *firmware, uint8_t rom_version, RtlFwPatch *patch);
+
+    bool loadPatchV1(RtlFwStream *stream, const rtl_epatch_header *header, uint8_t rom_version, int project_id, RtlFwPatch *patch);
+
+    RtlTransport        *m_pTransport;
+    RtlPendingCommand   m_pending[RTL_CMD_MAX_PENDING];
+    uint32_t            m_pendingHead;
+    uint32_t            m_pendingCount;
+    uint8_t             m_credits;
+    bool                m_pipelineError;
+    RtlEventWaiter      m_waiter;
+    RtlQueuedEvent      m_events[RTL_EVENT_QUEUE_LEN];
+    uint32_t            m_eventHead;
+    uint32_t            m_eventCount;
+    uint32_t            m_eventsDropped;
+    RtlEventHandlerSlot m_handlers[RTL_EVENT_MAX_HANDLERS];
+    bool                m_delivering;
+    RtlHciStats         m_stats;
+    RtlTraceRing        m_trace;
+    RtlSnoop            m_snoop;
+    IOReturn            m_lastReadError;
+    uint8_t             m_bulkEvent[HCI_MAX_EVENT_SIZE]; // for transports without pooled reads
+    const FwChip        *m_pChip;
+};
+
+#endif /* RtlCore_h */
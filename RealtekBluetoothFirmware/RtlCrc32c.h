@@ -0,0 +1,22 @@
+//
+//  RtlCrc32c.h
+//  RtlBluetoothFirmware
+//
+//  CRC32C (Castagnoli) used to check embedded firmware as it is decoded.
+//  Runs on the SSE4.2 crc32 instruction or the ARMv8 CRC32 extension when
+//  the CPU has one, on a table otherwise. generate_fw_data.py records the
+//  same checksum for every blob and patch at build time.
+//
+
+#ifndef RtlCrc32c_h
+#define RtlCrc32c_h
+
+#include "RtlPlatform.h"
+
+/*
+ * Extend crc, the result of a previous call or 0 to start, over len bytes
+ * of data. Chunks can be fed in any split.
+ */
+uint32_t rtlCrc32c(uint32_t crc, const void *data, size_t len);
+
+#endif /* RtlCrc32c_h */
@@ -0,0 +1,280 @@
+//
+//  RtlFwStream.cpp
+//  RtlBluetoothFirmware
+//
+//  Sequential reader over one embedded firmware blob, see RtlFwStream.h.
+//
+
+#include "RtlFwStream.h"
+#include "RtlLz4.h"
+#include "RtlCrc32c.h"
+#include "Log.h"
+
+#define RTL_FW_STREAM_SKIP_CHUNK 256
+
+/* Largest output of one inflate() call; both checksums follow it. */
+#define RTL_FW_STREAM_CRC_CHUNK  4096
+
+RtlFwStream::
+RtlFwStream()
+: m_pDesc(NULL), m_pDecoded(NULL), m_pDict(NULL), m_dictSize(0), m_inflating(false), m_offset(0), m_size(0),
+  m_crc(0), m_storedCrc(0), m_checked(false)
+{
+}
+
+RtlFwStream::
+~RtlFwStream()
+{
+    close();
+}
+
+bool RtlFwStream::
+open(const FwDesc *desc)
+{
+    close();
+    m_pDesc = desc;
+    m_offset = 0;
+    m_size = (uint32_t)(desc->codec == FW_CODEC_NONE ? desc->size : desc->uncompressed_size);
+    m_crc = 0;
+    m_storedCrc = 0;
+    m_checked = false;
+    if (desc->codec == FW_CODEC_NONE) {
+        return true;
+    }
+    if (desc->codec == FW_CODEC_LZ4) {
+        /* decode() has checked it already. */
+        m_pDecoded = (uint8_t *)IOMalloc(m_size);
+        if (!m_pDecoded || !decode(desc, m_pDecoded, m_size)) {
+            close();
+            return false;
+        }
+        m_checked = true;
+        return true;
+    }
+    if (desc->dict && !(m_pDict = loadDictionary(desc->dict, &m_dictSize))) {
+        m_pDesc = NULL;
+        return false;
+    }
+    memset(&m_zstream, 0, sizeof(m_zstream));
+    m_zstream.next_in = (unsigned char *)desc->var;
+    m_zstream.avail_in = (uint)desc->size;
+    m_zstream.zalloc = RTL_ZALLOC;
+    m_zstream.zfree = RTL_ZFREE;
+    m_zstream.opaque = Z_NULL;
+    if (inflateInit(&m_zstream) != Z_OK) {
+        XYLog("%s inflateInit failed for %s\n", __FUNCTION__, desc->name);
+        close();
+        return false;
+    }
+    m_inflating = true;
+    return true;
+}
+
+void RtlFwStream::
+close()
+{
+    if (m_inflating) {
+        inflateEnd(&m_zstream);
+        m_inflating = false;
+    }
+    if (m_pDecoded) {
+        IOFree(m_pDecoded, m_size);
+        m_pDecoded = NULL;
+    }
+    if (m_pDict) {
+        IOFree(m_pDict, m_dictSize);
+        m_pDict = NULL;
+    }
+    m_pDesc = NULL;
+}
+
+uint8_t *RtlFwStream::
+loadDictionary(const FwDesc *desc, uint32_t *len)
+{
+    uint8_t *dict;
+
+    /* Dictionaries are never encoded against another dictionary. */
+    if (desc->dict) {
+        return NULL;
+    }
+    *len = (uint32_t)(desc->codec == FW_CODEC_NONE ? desc->size : desc->uncompressed_size);
+    dict = (uint8_t *)IOMalloc(*len);
+    if (dict && !decode(desc, dict, *len)) {
+        IOFree(dict, *len);
+        dict = NULL;
+    }
+    return dict;
+}
+
+bool RtlFwStream::
+decode(const FwDesc *desc, uint8_t *dst, uint32_t len)
+{
+    RtlFwStream stream;
+    uint8_t *dict = NULL;
+    uint32_t dictLen = 0;
+    uint32_t storedCrc, crc;
+    bool ret;
+
+    if (len != (uint32_t)(desc->codec == FW_CODEC_NONE ? desc->size : desc->uncompressed_size)) {
+        return false;
+    }
+    if (desc->codec != FW_CODEC_LZ4) {
+        /* A stream read in one go checks as it copies or inflates. */
+        if (!stream.open(desc) || !stream.read(dst, len)) {
+            XYLog("%s failed to decode %s\n", __FUNCTION__, desc->name);
+            return false;
+        }
+        return true;
+    }
+    if (desc->dict && !(dict = loadDictionary(desc->dict, &dictLen))) {
+        XYLog("%s failed to load the dictionary of %s\n", __FUNCTION__, desc->name);
+        return false;
+    }
+    ret = rtlLz4Decompress(desc->var, (uint32_t)desc->size, dst, len, dict, dictLen, &storedCrc, &crc);
+    if (dict) {
+        IOFree(dict, dictLen);
+    }
+    if (!ret) {
+        XYLog("%s failed to decode %s\n", __FUNCTION__, desc->name);
+        return false;
+    }
+    return check(desc, storedCrc, crc);
+}
+
+bool RtlFwStream::
+verify(const FwDesc *desc, const uint8_t *data, uint32_t len)
+{
+    uint32_t crc = rtlCrc32c(0, data, len);
+
+    /* Stored and decoded bytes are the same ones here. */
+    return check(desc, crc, crc);
+}
+
+bool RtlFwStream::
+check(const FwDesc *desc, uint32_t storedCrc, uint32_t crc)
+{
+    if (storedCrc != desc->stored_crc32c) {
+        XYLog("%s CRC32C mismatch in the stored bytes of %s: 0x%08x, expected 0x%08x\n", __FUNCTION__, desc->name,
+              storedCrc, desc->stored_crc32c);
+        return false;
+    }
+    if (crc != desc->crc32c) {
+        XYLog("%s CRC32C mismatch in %s: 0x%08x, expected 0x%08x\n", __FUNCTION__, desc->name, crc, desc->crc32c);
+        return false;
+    }
+    return true;
+}
+
+bool RtlFwStream::
+account(const uint8_t *data, uint32_t len)
+{
+    if (m_checked) {
+        return true;
+    }
+    m_crc = rtlCrc32c(m_crc, data, len);
+    if (m_offset + len < m_size) {
+        return true;
+    }
+    m_checked = true;
+    return check(m_pDesc, m_crc, m_crc);
+}
+
+bool RtlFwStream::
+finish()
+{
+    uint8_t extra;
+    const unsigned char *in = m_zstream.next_in;
+    int err;
+
+    /* All output is out; let inflate consume the trailer, and nothing more. */
+    m_zstream.next_out = &extra;
+    m_zstream.avail_out = sizeof(extra);
+    err = inflate(&m_zstream, Z_FINISH);
+    m_storedCrc = rtlCrc32c(m_storedCrc, in, m_zstream.next_in - in);
+    m_checked = true;
+    if (err != Z_STREAM_END || m_zstream.avail_out == 0 || m_zstream.avail_in != 0) {
+        XYLog("%s %s does not end after %d bytes\n", __FUNCTION__, m_pDesc->name, m_size);
+        return false;
+    }
+    return check(m_pDesc, m_storedCrc, m_crc);
+}
+
+bool RtlFwStream::
+read(void *dst, uint32_t len)
+{
+    uint8_t *out = (uint8_t *)dst;
+    uint32_t left = len;
+
+    if (!m_pDesc || len > m_size - m_offset) {
+        return false;
+    }
+    if (!m_inflating) {
+        const uint8_t *src = (m_pDecoded ? m_pDecoded : m_pDesc->var) + m_offset;
+        memcpy(dst, src, len);
+        if (!account(src, len)) {
+            return false;
+        }
+        m_offset += len;
+        return true;
+    }
+    /* Bounded output per call, so the checksums run over bytes still in cache. */
+    while (left > 0) {
+        uint32_t chunk = left < RTL_FW_STREAM_CRC_CHUNK ? left : RTL_FW_STREAM_CRC_CHUNK;
+        const unsigned char *in = m_zstream.next_in;
+        uint32_t produced;
+        int err;
+
+        m_zstream.next_out = out;
+        m_zstream.avail_out = chunk;
+        err = inflate(&m_zstream, Z_SYNC_FLUSH);
+        if (err == Z_NEED_DICT && m_pDict) {
+            err = inflateSetDictionary(&m_zstream, m_pDict, m_dictSize);
+        }
+        produced = chunk - m_zstream.avail_out;
+        m_storedCrc = rtlCrc32c(m_storedCrc, in, m_zstream.next_in - in);
+        m_crc = rtlCrc32c(m_crc, out, produced);
+        out += produced;
+        left -= produced;
+        if (err == Z_STREAM_END && left > 0) {
+            XYLog("%s %s ended early at %d\n", __FUNCTION__, m_pDesc->name, (uint32_t)m_zstream.total_out);
+            return false;
+        }
+        if (err != Z_OK && err != Z_STREAM_END) {
+            XYLog("%s inflate failed for %s: %d\n", __FUNCTION__, m_pDesc->name, err);
+            return false;
+        }
+    }
+    m_offset += len;
+    if (m_offset == m_size && !m_checked) {
+        return finish();
+    }
+    return true;
+}
+
+bool RtlFwStream::
+seek(uint32_t offset)
+{
+    uint8_t scratch[RTL_FW_STREAM_SKIP_CHUNK];
+
+    if (!m_pDesc || offset < m_offset || offset > m_size) {
+        return false;
+    }
+    if (!m_inflating) {
+        /* Skipped bytes still count towards the checksum. */
+        if (!account((m_pDecoded ? m_pDecoded : m_pDesc->var) + m_offset, offset - m_offset)) {
+            return false;
+        }
+        m_offset = offset;
+        return true;
+    }
+    while (m_offset < offset) {
+        uint32_t chunk = offset - m_offset;
+        if (chunk > sizeof(scratch)) {
+            chunk = sizeof(scratch);
+        }
+        if (!read(scratch, chunk)) {
+            return false;
+        }
+    }
+    return true;
+}
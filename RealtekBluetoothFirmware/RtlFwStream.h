@@ -0,0 +1,74 @@
+//
+//  RtlFwStream.h
+//  RtlBluetoothFirmware
+//
+//  Sequential reader over one embedded firmware blob. zlib blobs are
+//  inflated on demand into whatever buffer the caller passes, so nothing
+//  has to be materialized that is not actually needed. LZ4 blobs decode
+//  fast enough that they are unpacked in one pass when opened. A blob that
+//  was encoded against another one as preset dictionary gets that one
+//  decoded first. The decoders fold the stored bytes they consume and the
+//  bytes they produce into two CRC32Cs as they go, a few KiB at a time,
+//  and compare both with what the generator recorded once the blob ends;
+//  there is no separate pass. A one-pass decode is therefore checked before
+//  anything is used, but a stream only fails on the read that returns its
+//  last byte, after everything before it has been handed out.
+//
+
+#ifndef RtlFwStream_h
+#define RtlFwStream_h
+
+#include "FwData.h"
+
+class RtlFwStream {
+public:
+    RtlFwStream();
+
+    ~RtlFwStream();
+
+    bool open(const FwDesc *desc);
+
+    void close();
+
+    /* Read exactly len bytes into dst. */
+    bool read(void *dst, uint32_t len);
+
+    /* Advance to an absolute offset at or past the current one. */
+    bool seek(uint32_t offset);
+
+    uint32_t offset() const { return m_offset; }
+
+    uint32_t size() const { return m_size; }
+
+    /* Decode a whole blob into dst, which holds its uncompressed size. */
+    static bool decode(const FwDesc *desc, uint8_t *dst, uint32_t len);
+
+    /* Check an uncompressed blob used in place, which no decoder reads. */
+    static bool verify(const FwDesc *desc, const uint8_t *data, uint32_t len);
+
+private:
+    static uint8_t *loadDictionary(const FwDesc *desc, uint32_t *len);
+
+    static bool check(const FwDesc *desc, uint32_t storedCrc, uint32_t crc);
+
+    /* Fold bytes about to be returned into the running checksum. */
+    bool account(const uint8_t *data, uint32_t len);
+
+    /* Consume the end of a zlib stream and compare both checksums. */
+    bool finish();
+
+private:
+    const FwDesc    *m_pDesc;
+    uint8_t         *m_pDecoded;
+    uint8_t         *m_pDict;
+    uint32_t        m_dictSize;
+    z_stream        m_zstream;
+    bool            m_inflating;
+    uint32_t        m_offset;
+    uint32_t        m_size;
+    uint32_t        m_crc;
+    uint32_t        m_storedCrc;
+    bool            m_checked;  // nothing left to check, or already checked
+};
+
+#endif /* RtlFwStream_h */
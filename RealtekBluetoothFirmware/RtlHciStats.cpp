@@ -0,0 +1,110 @@
+//
+//  RtlHciStats.cpp
+//  RtlBluetoothFirmware
+//
+//  HCI latency statistics, see RtlHciStats.h.
+//
+
+#include "RtlHciStats.h"
+
+RtlHciStats::
+RtlHciStats()
+: m_pLock(IOLockAlloc())
+{
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+RtlHciStats::
+~RtlHciStats()
+{
+    if (m_pLock) {
+        IOLockFree(m_pLock);
+    }
+}
+
+uint32_t RtlHciStats::
+bucketFor(uint64_t us)
+{
+    uint32_t bucket = 0;
+    while (bucket < RTL_STATS_BUCKETS - 1 && us >= (1ULL << bucket)) {
+        bucket++;
+    }
+    return bucket;
+}
+
+void RtlHciStats::
+record(uint16_t opcode, uint64_t startNs, bool ok, bool timedOut)
+{
+    uint64_t us = (RtlMonotonicNs() - startNs) / 1000;
+    RtlOpcodeStats *entry = NULL;
+
+    if (!m_pLock) {
+        return;
+    }
+    IOLockLock(m_pLock);
+    for (uint32_t i = 0; i < m_stats.numOpcodes; i++) {
+        if (m_stats.opcodes[i].opcode == opcode) {
+            entry = &m_stats.opcodes[i];
+            break;
+        }
+    }
+    if (!entry && m_stats.numOpcodes < RTL_STATS_MAX_OPCODES) {
+        entry = &m_stats.opcodes[m_stats.numOpcodes++];
+        entry->opcode = opcode;
+    }
+    if (entry) {
+        entry->count++;
+        entry->failures += !ok;
+        entry->timeouts += timedOut;
+        entry->totalUs += us;
+        if (us > entry->maxUs) {
+            entry->maxUs = us > 0xffffffffULL ? 0xffffffff : (uint32_t)us;
+        }
+        entry->buckets[bucketFor(us)]++;
+    } else {
+        m_stats.untracked++;
+    }
+    IOLockUnlock(m_pLock);
+}
+
+void RtlHciStats::
+countStall()
+{
+    if (m_pLock) {
+        IOLockLock(m_pLock);
+        m_stats.stallsCleared++;
+        IOLockUnlock(m_pLock);
+    }
+}
+
+void RtlHciStats::
+countRetry()
+{
+    if (m_pLock) {
+        IOLockLock(m_pLock);
+        m_stats.retries++;
+        IOLockUnlock(m_pLock);
+    }
+}
+
+void RtlHciStats::
+countTimeout()
+{
+    if (m_pLock) {
+        IOLockLock(m_pLock);
+        m_stats.timeouts++;
+        IOLockUnlock(m_pLock);
+    }
+}
+
+void RtlHciStats::
+snapshot(RtlHciStatsSnapshot *snapshot)
+{
+    if (!m_pLock) {
+        memset(snapshot, 0, sizeof(*snapshot));
+        return;
+    }
+    IOLockLock(m_pLock);
+    memcpy(snapshot, &m_stats, sizeof(*snapshot));
+    IOLockUnlock(m_pLock);
+}
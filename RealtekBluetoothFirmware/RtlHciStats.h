@@ -0,0 +1,62 @@
+//
+//  RtlHciStats.h
+//  RtlBluetoothFirmware
+//
+//  Per-opcode HCI command latency histograms and transport error counters.
+//  Recording is a short locked update, snapshot() copies everything out
+//  so it can be read while commands keep flowing.
+//
+
+#ifndef RtlHciStats_h
+#define RtlHciStats_h
+
+#include "RtlPlatform.h"
+
+#define RTL_STATS_MAX_OPCODES   16
+/* Bucket i counts latencies below 2^i us; the last one takes the rest. */
+#define RTL_STATS_BUCKETS       21
+
+typedef struct {
+    uint16_t    opcode;
+    uint32_t    count;
+    uint32_t    failures;
+    uint32_t    timeouts;
+    uint32_t    maxUs;
+    uint64_t    totalUs;
+    uint32_t    buckets[RTL_STATS_BUCKETS];
+} RtlOpcodeStats;
+
+typedef struct {
+    RtlOpcodeStats  opcodes[RTL_STATS_MAX_OPCODES];
+    uint32_t        numOpcodes;
+    uint32_t        untracked;      // commands past RTL_STATS_MAX_OPCODES opcodes
+    uint32_t        stallsCleared;
+    uint32_t        retries;
+    uint32_t        timeouts;
+} RtlHciStatsSnapshot;
+
+class RtlHciStats {
+public:
+    RtlHciStats();
+
+    ~RtlHciStats();
+
+    /* One command that was sent at startNs and has just finished. */
+    void record(uint16_t opcode, uint64_t startNs, bool ok, bool timedOut);
+
+    void countStall();
+
+    void countRetry();
+
+    void countTimeout();
+
+    void snapshot(RtlHciStatsSnapshot *snapshot);
+
+    static uint32_t bucketFor(uint64_t us);
+
+private:
+    IOLock              *m_pLock;
+    RtlHciStatsSnapshot m_stats;
+};
+
+#endif /* RtlHciStats_h */
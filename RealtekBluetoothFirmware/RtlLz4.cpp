@@ -0,0 +1,128 @@
+//
+//  RtlLz4.cpp
+//  RtlBluetoothFirmware
+//
+//  LZ4 block decoder, see RtlLz4.h.
+//
+
+#include "RtlLz4.h"
+#include "RtlCrc32c.h"
+
+/* Bytes decoded between two checksum updates. */
+#define RTL_LZ4_CRC_CHUNK 4096
+
+/* Extend a 15 length nibble with the 255-terminated bytes that follow it. */
+static inline bool
+rtlLz4Length(const uint8_t **ip, const uint8_t *end, uint32_t *length)
+{
+    uint8_t b;
+
+    if (*length != 15) {
+        return true;
+    }
+    do {
+        if (*ip >= end) {
+            return false;
+        }
+        b = *(*ip)++;
+        *length += b;
+    } while (b == 255);
+    return true;
+}
+
+/* Fold what was consumed and produced since the marks into the checksums. */
+static inline void
+rtlLz4Fold(const uint8_t **ipMark, const uint8_t *ip, const uint8_t **opMark, const uint8_t *op,
+           uint32_t *srcCrc, uint32_t *dstCrc)
+{
+    if (srcCrc) {
+        *srcCrc = rtlCrc32c(*srcCrc, *ipMark, ip - *ipMark);
+    }
+    if (dstCrc) {
+        *dstCrc = rtlCrc32c(*dstCrc, *opMark, op - *opMark);
+    }
+    *ipMark = ip;
+    *opMark = op;
+}
+
+bool
+rtlLz4Decompress(const uint8_t *src, uint32_t srcLen, uint8_t *dst, uint32_t dstLen,
+                 const uint8_t *dict, uint32_t dictLen, uint32_t *srcCrc, uint32_t *dstCrc)
+{
+    const uint8_t *ip = src;
+    const uint8_t *ipEnd = src + srcLen;
+    uint8_t *op = dst;
+    uint8_t *opEnd = dst + dstLen;
+    const uint8_t *ipMark = src;
+    const uint8_t *opMark = dst;
+    bool check = srcCrc || dstCrc;
+
+    if (srcCrc) {
+        *srcCrc = 0;
+    }
+    if (dstCrc) {
+        *dstCrc = 0;
+    }
+    while (ip < ipEnd) {
+        /* Output below op is final, matches only read it back. */
+        if (check && op - opMark >= RTL_LZ4_CRC_CHUNK) {
+            rtlLz4Fold(&ipMark, ip, &opMark, op, srcCrc, dstCrc);
+        }
+
+        uint8_t token = *ip++;
+        uint32_t literals = token >> 4;
+        uint32_t matchLen = token & 0xf;
+        uint32_t offset;
+
+        if (!rtlLz4Length(&ip, ipEnd, &literals) ||
+            literals > (uint32_t)(ipEnd - ip) || literals > (uint32_t)(opEnd - op)) {
+            return false;
+        }
+        memcpy(op, ip, literals);
+        ip += literals;
+        op += literals;
+
+        /* The last sequence carries literals only. */
+        if (ip == ipEnd) {
+            break;
+        }
+        if (ipEnd - ip < 2) {
+            return false;
+        }
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (!rtlLz4Length(&ip, ipEnd, &matchLen)) {
+            return false;
+        }
+        matchLen += 4;
+        if (offset == 0 || offset > (uint32_t)(op - dst) + dictLen || matchLen > (uint32_t)(opEnd - op)) {
+            return false;
+        }
+
+        /* The part of a match that lies in the dictionary comes first. */
+        if (offset > (uint32_t)(op - dst)) {
+            uint32_t back = offset - (uint32_t)(op - dst);
+            uint32_t chunk = back < matchLen ? back : matchLen;
+            memcpy(op, dict + dictLen - back, chunk);
+            op += chunk;
+            matchLen -= chunk;
+        }
+
+        /* Matches may overlap their own output, so non-overlapping ones
+         * are the only ones that can be copied in bulk.
+         */
+        if (offset >= matchLen) {
+            memcpy(op, op - offset, matchLen);
+            op += matchLen;
+        } else {
+            const uint8_t *match = op - offset;
+            while (matchLen--) {
+                *op++ = *match++;
+            }
+        }
+    }
+    if (check) {
+        rtlLz4Fold(&ipMark, ip, &opMark, op, srcCrc, dstCrc);
+    }
+    return op == opEnd;
+}
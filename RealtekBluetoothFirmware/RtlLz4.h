@@ -0,0 +1,25 @@
+//
+//  RtlLz4.h
+//  RtlBluetoothFirmware
+//
+//  Decoder for the LZ4 block format, used for embedded firmware that has
+//  to be unpacked quickly. The encoder lives in generate_fw_data.py.
+//
+
+#ifndef RtlLz4_h
+#define RtlLz4_h
+
+#include "RtlPlatform.h"
+
+/*
+ * Decode one LZ4 block of srcLen bytes. Succeeds only if it expands to
+ * exactly dstLen bytes; malformed input never reads or writes out of bounds.
+ * Matches may reach back into dict, which is treated as the data that
+ * preceded dst. srcCrc and dstCrc, if set, receive the CRC32C of the input
+ * and of the output, folded in chunks while the bytes are still in cache.
+ */
+bool rtlLz4Decompress(const uint8_t *src, uint32_t srcLen, uint8_t *dst, uint32_t dstLen,
+                      const uint8_t *dict = NULL, uint32_t dictLen = 0,
+                      uint32_t *srcCrc = NULL, uint32_t *dstCrc = NULL);
+
+#endif /* RtlLz4_h */
@@ -0,0 +1,210 @@
+//
+//  RtlPatchCache.cpp
+//  RtlBluetoothFirmware
+//
+//  Shared patch cache, see RtlPatchCache.h.
+//
+
+#include "RtlPatchCache.h"
+#include "Log.h"
+
+/* Zero-initialized, so no static constructor is needed; the lock is
+ * created on first use.
+ */
+static RtlPatchCache gRtlPatchCache;
+
+RtlPatchCache *RtlPatchCache::
+shared()
+{
+    return &gRtlPatchCache;
+}
+
+IOLock *RtlPatchCache::
+lock()
+{
+    if (!m_pLock) {
+        IOLock *lock = IOLockAlloc();
+        if (lock && !OSCompareAndSwapPtr(NULL, lock, (void * volatile *)&m_pLock)) {
+            IOLockFree(lock);
+        }
+    }
+    return m_pLock;
+}
+
+RtlPatchCacheEntry *RtlPatchCache::
+find(const char *name, uint8_t rom_version, int project_id)
+{
+    for (int i = 0; i < RTL_PATCH_CACHE_ENTRIES; i++) {
+        RtlPatchCacheEntry *entry = &m_entries[i];
+        if (entry->used && entry->romVersion == rom_version && entry->projectId == project_id &&
+            strcmp(entry->name, name) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+void RtlPatchCache::
+evict(RtlPatchCacheEntry *entry)
+{
+    m_bytes -= entry->patch.storage.allocSize;
+    RtlCore::releaseFwPatch(&entry->patch);
+    entry->used = false;
+}
+
+/* Evict unreferenced entries, oldest first, until size more bytes and one
+ * more entry fit.
+ */
+bool RtlPatchCache::
+makeRoom(uint32_t size)
+{
+    if (size > RTL_PATCH_CACHE_CAPACITY) {
+        return false;
+    }
+    while (true) {
+        RtlPatchCacheEntry *victim = NULL;
+        bool freeSlot = false;
+
+        for (int i = 0; i < RTL_PATCH_CACHE_ENTRIES; i++) {
+            RtlPatchCacheEntry *entry = &m_entries[i];
+            if (!entry->used) {
+                freeSlot = true;
+            } else if (entry->refCount == 0 && (!victim || entry->lastUse < victim->lastUse)) {
+                victim = entry;
+            }
+        }
+        if (freeSlot && m_bytes + size <= RTL_PATCH_CACHE_CAPACITY) {
+            return true;
+        }
+        if (!victim) {
+            return false;
+        }
+        XYLog("Patch cache evicting %s ROM version 0x%02x\n", victim->name, victim->romVersion);
+        evict(victim);
+        m_evictions++;
+    }
+}
+
+RtlPatchCacheEntry *RtlPatchCache::
+acquire(const char *name, uint8_t rom_version, int project_id)
+{
+    RtlPatchCacheEntry *entry;
+
+    if (!lock()) {
+        return NULL;
+    }
+    IOLockLock(m_pLock);
+    entry = find(name, rom_version, project_id);
+    if (entry) {
+        entry->refCount++;
+        entry->lastUse = ++m_clock;
+        m_hits++;
+    } else {
+        m_misses++;
+    }
+    IOLockUnlock(m_pLock);
+    return entry;
+}
+
+RtlPatchCacheEntry *RtlPatchCache::
+insert(const char *name, uint8_t rom_version, int project_id, RtlFwPatch *patch)
+{
+    RtlPatchCacheEntry *entry;
+
+    /* Rodata patches cost nothing to rebuild and are not worth a slot. */
+    if (!patch->storage.alloc || !lock()) {
+        return NULL;
+    }
+    IOLockLock(m_pLock);
+    entry = find(name, rom_version, project_id);
+    if (entry) {
+        RtlCore::releaseFwPatch(patch);
+    } else if (makeRoom(patch->storage.allocSize)) {
+        for (entry = m_entries; entry->used; entry++) {
+        }
+        entry->name = name;
+        entry->romVersion = rom_version;
+        entry->projectId = project_id;
+        entry->patch = *patch;
+        entry->refCount = 0;
+        entry->used = true;
+        m_bytes += patch->storage.allocSize;
+        memset(patch, 0, sizeof(*patch));
+    }
+    if (entry) {
+        entry->refCount++;
+        entry->lastUse = ++m_clock;
+    }
+    IOLockUnlock(m_pLock);
+    return entry;
+}
+
+void RtlPatchCache::
+release(RtlPatchCacheEntry *entry)
+{
+    if (!entry || !lock()) {
+        return;
+    }
+    IOLockLock(m_pLock);
+    entry->refCount--;
+    IOLockUnlock(m_pLock);
+}
+
+void RtlPatchCache::
+purge()
+{
+    if (!lock()) {
+        return;
+    }
+    IOLockLock(m_pLock);
+    for (int i = 0; i < RTL_PATCH_CACHE_ENTRIES; i++) {
+        if (m_entries[i].used && m_entries[i].refCount == 0) {
+            evict(&m_entries[i]);
+        }
+    }
+    IOLockUnlock(m_pLock);
+}
+
+void RtlPatchCache::
+teardown()
+{
+    IOLock *lock = m_pLock;
+
+    if (!lock) {
+        return;
+    }
+    IOLockLock(lock);
+    for (int i = 0; i < RTL_PATCH_CACHE_ENTRIES; i++) {
+        RtlPatchCacheEntry *entry = &m_entries[i];
+        if (!entry->used) {
+            continue;
+        }
+        if (entry->refCount) {
+            XYLog("Patch cache %s ROM version 0x%02x still has %d users, leaking it\n", entry->name,
+                  entry->romVersion, entry->refCount);
+            continue;
+        }
+        evict(entry);
+    }
+    m_pLock = NULL;
+    IOLockUnlock(lock);
+    IOLockFree(lock);
+}
+
+void RtlPatchCache::
+getStats(RtlPatchCacheStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (!lock()) {
+        return;
+    }
+    IOLockLock(m_pLock);
+    stats->hits = m_hits;
+    stats->misses = m_misses;
+    stats->evictions = m_evictions;
+    stats->bytes = m_bytes;
+    for (int i = 0; i < RTL_PATCH_CACHE_ENTRIES; i++) {
+        stats->entries += m_entries[i].used;
+    }
+    IOLockUnlock(m_pLock);
+}
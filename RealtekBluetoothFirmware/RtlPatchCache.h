@@ -0,0 +1,87 @@
+//
+//  RtlPatchCache.h
+//  RtlBluetoothFirmware
+//
+//  Process-wide cache of inflated patches, shared read-only between
+//  controllers so a second identical dongle or a replug does not inflate
+//  the same patch again. Entries are refcounted and the unreferenced ones
+//  are evicted least recently used first once the memory cap is reached.
+//
+
+#ifndef RtlPatchCache_h
+#define RtlPatchCache_h
+
+#include "RtlCore.h"
+
+#define RTL_PATCH_CACHE_CAPACITY    (512 * 1024)
+#define RTL_PATCH_CACHE_ENTRIES     8
+
+typedef struct {
+    const char      *name;      // embedded rodata, lives as long as the kext
+    uint8_t         romVersion;
+    int             projectId;
+    RtlFwPatch      patch;
+    uint32_t        refCount;
+    uint64_t        lastUse;
+    bool            used;
+} RtlPatchCacheEntry;
+
+typedef struct {
+    uint32_t        hits;
+    uint32_t        misses;
+    uint32_t        evictions;
+    uint32_t        entries;
+    uint32_t        bytes;
+} RtlPatchCacheStats;
+
+class RtlPatchCache {
+public:
+    static RtlPatchCache *shared();
+
+    /*
+     * Look a patch up. On a hit the entry is referenced and must be given
+     * back with release(); its patch must not be modified.
+     */
+    RtlPatchCacheEntry *acquire(const char *name, uint8_t rom_version, int project_id);
+
+    /*
+     * Hand patch over to the cache and get it back referenced. If the key
+     * is already cached the existing entry wins and patch is released.
+     * Returns NULL, leaving patch to the caller, when it does not fit.
+     */
+    RtlPatchCacheEntry *insert(const char *name, uint8_t rom_version, int project_id, RtlFwPatch *patch);
+
+    void release(RtlPatchCacheEntry *entry);
+
+    /* Drop every unreferenced entry. */
+    void purge();
+
+    /*
+     * Free every entry and the lock before the kext is unloaded, once no
+     * controller is left to use the cache. An entry still referenced is
+     * reported and leaked rather than freed under its user.
+     */
+    void teardown();
+
+    void getStats(RtlPatchCacheStats *stats);
+
+private:
+    IOLock *lock();
+
+    RtlPatchCacheEntry *find(const char *name, uint8_t rom_version, int project_id);
+
+    bool makeRoom(uint32_t size);
+
+    void evict(RtlPatchCacheEntry *entry);
+
+private:
+    IOLock              *m_pLock;
+    RtlPatchCacheEntry  m_entries[RTL_PATCH_CACHE_ENTRIES];
+    uint64_t            m_clock;
+    uint32_t            m_bytes;
+    uint32_t            m_hits;
+    uint32_t            m_misses;
+    uint32_t            m_evictions;
+};
+
+#endif /* RtlPatchCache_h */
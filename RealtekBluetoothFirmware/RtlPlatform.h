@@ -0,0 +1,167 @@
+//
+//  RtlPlatform.h
+//  RtlBluetoothFirmware
+//
+//  Minimal platform layer for the portable firmware loader core.
+//  Inside the kext this is a thin wrapper around IOKit/libkern, on a host
+//  build it maps the same names onto libc so RtlCore can run without IOKit.
+//
+
+#ifndef RtlPlatform_h
+#define RtlPlatform_h
+
+#ifdef KERNEL
+
+#include <IOKit/IOLib.h>
+#include <IOKit/IOLocks.h>
+#include <IOKit/IOReturn.h>
+#include <libkern/libkern.h>
+#include <libkern/OSAtomic.h>
+#include <libkern/OSByteOrder.h>
+#include <mach/mach_time.h>
+#include <kern/clock.h>
+#include <string.h>
+
+static inline uint64_t RtlMonotonicNs()
+{
+    uint64_t ns;
+    absolutetime_to_nanoseconds(mach_absolute_time(), &ns);
+    return ns;
+}
+
+/* Microseconds since the Unix epoch. */
+static inline uint64_t RtlWallClockUs()
+{
+    clock_sec_t sec;
+    clock_usec_t usec;
+    clock_get_calendar_microtime(&sec, &usec);
+    return (uint64_t)sec * 1000000ULL + usec;
+}
+
+#else /* !KERNEL */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <time.h>
+#include <pthread.h>
+
+typedef uint8_t  UInt8;
+typedef uint16_t UInt16;
+typedef uint32_t UInt32;
+typedef uint64_t UInt64;
+typedef int8_t   SInt8;
+typedef int16_t  SInt16;
+typedef int32_t  SInt32;
+typedef int64_t  SInt64;
+
+typedef int IOReturn;
+
+#define kIOReturnSuccess        0
+#define kIOReturnError          ((IOReturn)0xe00002bc)
+#define kIOReturnNoMemory       ((IOReturn)0xe00002bd)
+#define kIOReturnNoResources    ((IOReturn)0xe00002be)
+#define kIOReturnBadArgument    ((IOReturn)0xe00002c2)
+#define kIOReturnUnsupported    ((IOReturn)0xe00002c7)
+#define kIOReturnBusy           ((IOReturn)0xe00002d5)
+#define kIOReturnTimeout        ((IOReturn)0xe00002d6)
+#define kIOReturnUnderrun       ((IOReturn)0xe00002e7)
+#define kIOReturnOverrun        ((IOReturn)0xe00002e8)
+#define kIOReturnAborted        ((IOReturn)0xe00002eb)
+#define kIOReturnNotResponding  ((IOReturn)0xe00002ed)
+#define kIOReturnNotFound       ((IOReturn)0xe00002f0)
+
+#define OSSwapHostToLittleInt16(x)  htole16(x)
+#define OSSwapHostToLittleInt32(x)  htole32(x)
+#define OSSwapLittleToHostInt16(x)  le16toh(x)
+#define OSSwapLittleToHostInt32(x)  le32toh(x)
+
+static inline uint16_t OSReadLittleInt16(const volatile void *base, uintptr_t offset)
+{
+    uint16_t v;
+    memcpy(&v, (const uint8_t *)base + offset, sizeof(v));
+    return le16toh(v);
+}
+
+static inline uint32_t OSReadLittleInt32(const volatile void *base, uintptr_t offset)
+{
+    uint32_t v;
+    memcpy(&v, (const uint8_t *)base + offset, sizeof(v));
+    return le32toh(v);
+}
+
+static inline void OSWriteLittleInt32(volatile void *base, uintptr_t offset, uint32_t data)
+{
+    data = htole32(data);
+    memcpy((uint8_t *)base + offset, &data, sizeof(data));
+}
+
+#define IOLog(fmt, x...) printf(fmt, ##x)
+
+static inline void *IOMalloc(size_t size)
+{
+    return malloc(size);
+}
+
+static inline void IOFree(void *address, size_t size)
+{
+    (void)size;
+    free(address);
+}
+
+typedef pthread_mutex_t IOLock;
+
+static inline IOLock *IOLockAlloc()
+{
+    IOLock *lock = (IOLock *)malloc(sizeof(IOLock));
+    if (lock) {
+        pthread_mutex_init(lock, NULL);
+    }
+    return lock;
+}
+
+static inline void IOLockFree(IOLock *lock)
+{
+    pthread_mutex_destroy(lock);
+    free(lock);
+}
+
+static inline void IOLockLock(IOLock *lock)
+{
+    pthread_mutex_lock(lock);
+}
+
+static inline void IOLockUnlock(IOLock *lock)
+{
+    pthread_mutex_unlock(lock);
+}
+
+static inline bool OSCompareAndSwapPtr(void *oldValue, void *newValue, void * volatile *address)
+{
+    return __sync_bool_compare_and_swap(address, oldValue, newValue);
+}
+
+static inline uint64_t RtlMonotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static inline uint64_t RtlWallClockUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000;
+}
+
+#endif /* KERNEL */
+
+#ifndef __packed
+#define __packed __attribute__((packed))
+#endif
+
+#endif /* RtlPlatform_h */
@@ -0,0 +1,173 @@
+//
+//  RtlSetupScheduler.cpp
+//  RtlBluetoothFirmware
+//
+//  Bounded bring-up workers, see RtlSetupScheduler.h.
+//
+
+#include "RtlSetupScheduler.h"
+#include "Log.h"
+
+static RtlSetupScheduler gRtlSetupScheduler;
+
+RtlSetupScheduler::
+RtlSetupScheduler() : m_sequence(0), m_running(0)
+{
+    m_pLock = IOLockAlloc();
+    for (int i = 0; i < RTL_SETUP_MAX_JOBS; i++) {
+        m_jobs[i].state = kRtlSetupFree;
+        m_jobs[i].owner = NULL;
+        m_jobs[i].call = thread_call_allocate(run, &m_jobs[i]);
+    }
+}
+
+/* Nothing is left to run by the time the kext unloads. */
+RtlSetupScheduler::
+~RtlSetupScheduler()
+{
+    for (int i = 0; i < RTL_SETUP_MAX_JOBS; i++) {
+        if (m_jobs[i].call) {
+            thread_call_free(m_jobs[i].call);
+            m_jobs[i].call = NULL;
+        }
+    }
+    if (m_pLock) {
+        IOLockFree(m_pLock);
+        m_pLock = NULL;
+    }
+}
+
+RtlSetupScheduler *RtlSetupScheduler::
+shared()
+{
+    return &gRtlSetupScheduler;
+}
+
+bool RtlSetupScheduler::
+submit(OSObject *owner, uint32_t bus, RtlSetupFunction function)
+{
+    RtlSetupJob *job = NULL;
+
+    if (!m_pLock) {
+        return false;
+    }
+    IOLockLock(m_pLock);
+    for (int i = 0; i < RTL_SETUP_MAX_JOBS; i++) {
+        if (m_jobs[i].state == kRtlSetupFree && m_jobs[i].call) {
+            job = &m_jobs[i];
+            break;
+        }
+    }
+    if (!job) {
+        IOLockUnlock(m_pLock);
+        XYLog("%s no free job slot\n", __FUNCTION__);
+        return false;
+    }
+    owner->retain();
+    job->owner = owner;
+    job->function = function;
+    job->bus = bus;
+    job->sequence = ++m_sequence;
+    job->state = kRtlSetupQueued;
+    XYLog("Queued bring-up on bus 0x%02x, %d running\n", bus, m_running);
+    pump();
+    IOLockUnlock(m_pLock);
+    return true;
+}
+
+/* Start queued jobs, oldest first, while the limits allow. Called locked. */
+void RtlSetupScheduler::
+pump()
+{
+    while (m_running < RTL_SETUP_MAX_WORKERS) {
+        RtlSetupJob *next = NULL;
+
+        for (int i = 0; i < RTL_SETUP_MAX_JOBS; i++) {
+            RtlSetupJob *job = &m_jobs[i];
+            uint32_t onBus = 0;
+
+            if (job->state != kRtlSetupQueued || (next && next->sequence < job->sequence)) {
+                continue;
+            }
+            for (int j = 0; j < RTL_SETUP_MAX_JOBS; j++) {
+                onBus += m_jobs[j].state == kRtlSetupRunning && m_jobs[j].bus == job->bus;
+            }
+            if (onBus < RTL_SETUP_MAX_PER_BUS) {
+                next = job;
+            }
+        }
+        if (!next) {
+            return;
+        }
+        next->state = kRtlSetupRunning;
+        m_running++;
+        thread_call_enter(next->call);
+    }
+}
+
+/*
+ * Give a started job's slot and worker back and wake a cancel() waiting
+ * for it. Called locked; the caller releases the owner once unlocked.
+ */
+void RtlSetupScheduler::
+finish(RtlSetupJob *job)
+{
+    job->state = kRtlSetupFree;
+    job->owner = NULL;
+    m_running--;
+    pump();
+    IOLockWakeup(m_pLock, job, false);
+}
+
+void RtlSetupScheduler::
+run(thread_call_param_t param0, thread_call_param_t param1)
+{
+    RtlSetupJob *job = (RtlSetupJob *)param0;
+    RtlSetupScheduler *scheduler = shared();
+    OSObject *owner = job->owner;
+
+    job->function(owner);
+
+    // The slot may be reused as soon as the lock is dropped
+    IOLockLock(scheduler->m_pLock);
+    scheduler->finish(job);
+    IOLockUnlock(scheduler->m_pLock);
+    owner->release();
+}
+
+void RtlSetupScheduler::
+cancel(OSObject *owner)
+{
+    RtlSetupJob *job = NULL;
+
+    if (!m_pLock) {
+        return;
+    }
+    IOLockLock(m_pLock);
+    for (int i = 0; i < RTL_SETUP_MAX_JOBS; i++) {
+        if (m_jobs[i].state != kRtlSetupFree && m_jobs[i].owner == owner) {
+            job = &m_jobs[i];
+            break;
+        }
+    }
+    if (!job) {
+        IOLockUnlock(m_pLock);
+        return;
+    }
+    if (job->state == kRtlSetupQueued) {
+        job->state = kRtlSetupFree;
+        job->owner = NULL;
+    } else if (thread_call_cancel(job->call)) {
+        // Started but not yet picked up by a thread, it never runs
+        finish(job);
+    } else {
+        // Its worker releases the owner, the caller's reference keeps it alive
+        while (job->state != kRtlSetupFree && job->owner == owner) {
+            IOLockSleep(m_pLock, job, THREAD_UNINT);
+        }
+        IOLockUnlock(m_pLock);
+        return;
+    }
+    IOLockUnlock(m_pLock);
+    owner->release();
+}
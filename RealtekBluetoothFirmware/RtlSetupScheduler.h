@@ -0,0 +1,78 @@
+//
+//  RtlSetupScheduler.h
+//  RtlBluetoothFirmware
+//
+//  Runs controller bring-up on thread calls instead of the IOKit matching
+//  thread, so start() returns at once and several dongles come up in
+//  parallel. At most RTL_SETUP_MAX_WORKERS bring-ups run at a time, and at
+//  most RTL_SETUP_MAX_PER_BUS on one USB bus so downloads sharing a bus do
+//  not starve each other; the rest wait in FIFO order.
+//
+
+#ifndef RtlSetupScheduler_h
+#define RtlSetupScheduler_h
+
+#include <IOKit/IOLib.h>
+#include <IOKit/IOLocks.h>
+#include <kern/thread_call.h>
+#include <libkern/c++/OSObject.h>
+
+#define RTL_SETUP_MAX_WORKERS   4
+#define RTL_SETUP_MAX_PER_BUS   2
+#define RTL_SETUP_MAX_JOBS      16
+
+typedef void (*RtlSetupFunction)(OSObject *owner);
+
+typedef enum {
+    kRtlSetupFree = 0,
+    kRtlSetupQueued,
+    kRtlSetupRunning,
+} RtlSetupState;
+
+typedef struct {
+    RtlSetupState       state;
+    OSObject            *owner;     // retained while queued or running
+    RtlSetupFunction    function;
+    uint32_t            bus;
+    uint64_t            sequence;
+    thread_call_t       call;       // the slot's own, allocated with the scheduler
+} RtlSetupJob;
+
+/*
+ * A job gives its slot back as soon as it has run, so the slots bound the
+ * bring-ups in flight, not the devices attached. The lock and the thread
+ * calls live as long as the kext: they are allocated when its static
+ * constructors run and freed by its static destructors.
+ */
+class RtlSetupScheduler {
+public:
+    RtlSetupScheduler();
+
+    ~RtlSetupScheduler();
+
+    static RtlSetupScheduler *shared();
+
+    /* Queue function(owner) to run on a worker once bus has a free slot. */
+    bool submit(OSObject *owner, uint32_t bus, RtlSetupFunction function);
+
+    /*
+     * Forget owner's job: a queued one is dropped, a running one is waited
+     * for. Must be called before owner goes away.
+     */
+    void cancel(OSObject *owner);
+
+private:
+    void pump();
+
+    void finish(RtlSetupJob *job);
+
+    static void run(thread_call_param_t param0, thread_call_param_t param1);
+
+private:
+    IOLock          *m_pLock;
+    RtlSetupJob     m_jobs[RTL_SETUP_MAX_JOBS];
+    uint64_t        m_sequence;
+    uint32_t        m_running;
+};
+
+#endif /* RtlSetupScheduler_h */
@@ -0,0 +1,361 @@
+//
+//  RtlSimController.cpp
+//  RtlBluetoothFirmware
+//
+//  Software Realtek controller, see RtlSimController.h.
+//
+
+#include "RtlSimController.h"
+#include "RtlCore.h"
+#include "Log.h"
+
+#define RTL_SIM_STATUS_SUCCESS          0x00
+#define RTL_SIM_STATUS_UNKNOWN_COMMAND  0x01
+#define RTL_SIM_STATUS_INVALID_PARAMS   0x12
+
+const RtlSimLatency rtlSimLatencyFullSpeed = {
+    .controlNs = 1000000,
+    .interruptIntervalNs = 1000000,
+    .byteNs = 667,
+    .commandNs = 20000,
+    .downloadNs = 50000,
+};
+
+const RtlSimLatency rtlSimLatencyHighSpeed = {
+    .controlNs = 250000,
+    .interruptIntervalNs = 125000,
+    .byteNs = 17,
+    .commandNs = 20000,
+    .downloadNs = 50000,
+};
+
+RtlSimController::
+RtlSimController(uint16_t lmpSubversion, uint16_t hciRev, uint8_t hciVer, uint8_t romVersion)
+: m_lmpSubversion(lmpSubversion), m_hciRev(hciRev), m_hciVer(hciVer), m_romVersion(romVersion)
+{
+    memset(&m_intrQueue, 0, sizeof(m_intrQueue));
+    memset(&m_bulkQueue, 0, sizeof(m_bulkQueue));
+    m_commandCount = 0;
+    m_commandCredits = 1;
+    m_creditViolations = 0;
+    m_bulkBufferBusy = false;
+    m_bulkReadBusy = false;
+    setLatencyModel(NULL);
+    powerCycle();
+}
+
+void RtlSimController::
+setLatencyModel(const RtlSimLatency *model, uint32_t seed)
+{
+    if (model) {
+        m_latency = *model;
+    } else {
+        memset(&m_latency, 0, sizeof(m_latency));
+    }
+    m_clockNs = 0;
+    m_busyUntilNs = 0;
+    m_rng = seed ? seed : 1;
+}
+
+void RtlSimController::
+chargeTransfer(uint32_t setupNs, uint32_t bytes)
+{
+    m_clockNs += setupNs + (uint64_t)bytes * m_latency.byteNs;
+}
+
+/* How long until the host polls the interrupt endpoint next. */
+uint32_t RtlSimController::
+pollPhase()
+{
+    if (!m_latency.interruptIntervalNs) {
+        return 0;
+    }
+    m_rng ^= m_rng << 13;
+    m_rng ^= m_rng >> 17;
+    m_rng ^= m_rng << 5;
+    return m_rng % m_latency.interruptIntervalNs;
+}
+
+void RtlSimController::
+powerCycle()
+{
+    m_patched = false;
+    m_patchVersion = 0;
+    m_nextFragment = 0;
+    m_downloadedBytes = 0;
+    m_downloadedFragments = 0;
+    memset(m_lastFragmentTail, 0, sizeof(m_lastFragmentTail));
+    m_sawConfig = false;
+    m_configVersion = 0;
+    m_intrQueue.head = m_intrQueue.count = 0;
+    m_bulkQueue.head = m_bulkQueue.count = 0;
+}
+
+void RtlSimController::
+queueCommandComplete(RtlSimEventQueue *queue, uint16_t opcode, const void *param, uint8_t plen)
+{
+    if (queue->count == RTL_SIM_EVENT_QUEUE_LEN) {
+        XYLog("%s event queue overrun, dropping 0x%04x\n", __FUNCTION__, opcode);
+        return;
+    }
+    RtlSimEvent *event = &queue->events[(queue->head + queue->count) % RTL_SIM_EVENT_QUEUE_LEN];
+    HciResponse *resp = (HciResponse *)event->data;
+    uint8_t evtLen = (uint8_t)(sizeof(HciResponse) - HCI_EVENT_HDR_SIZE + plen);
+
+    /* The controller works through commands one at a time. */
+    m_busyUntilNs = (m_busyUntilNs > m_clockNs ? m_busyUntilNs : m_clockNs) +
+                    (opcode == HCI_OP_RTL_DOWNLOAD_FW ? m_latency.downloadNs : m_latency.commandNs);
+    event->readyNs = m_busyUntilNs;
+    resp->evt.evt = HCI_EV_CMD_COMPLETE;
+    resp->evt.len = evtLen;
+    resp->numCommands = 1;
+    resp->opcode = OSSwapHostToLittleInt16(opcode);
+    memcpy(resp->data, param, plen);
+    event->len = HCI_EVENT_HDR_SIZE + evtLen;
+    queue->count++;
+}
+
+IOReturn RtlSimController::
+popEvent(RtlSimEventQueue *queue, void *buf, uint32_t buf_size, uint32_t *size)
+{
+    if (queue->count == 0) {
+        return kIOReturnTimeout;
+    }
+    RtlSimEvent *event = &queue->events[queue->head];
+    uint32_t len = event->len < buf_size ? event->len : buf_size;
+    if (event->readyNs > m_clockNs) {
+        m_clockNs = event->readyNs;
+    }
+    chargeTransfer(pollPhase(), event->len);
+    if (buf) {
+        memcpy(buf, event->data, len);
+    }
+    if (size) {
+        *size = len;
+    }
+    queue->head = (queue->head + 1) % RTL_SIM_EVENT_QUEUE_LEN;
+    queue->count--;
+    /* Grant whatever is free once the completions still queued are counted. */
+    if (buf && len >= sizeof(HciResponse) && event->data[0] == HCI_EV_CMD_COMPLETE) {
+        ((HciResponse *)buf)->numCommands = queue->count < m_commandCredits ? m_commandCredits - queue->count : 0;
+    }
+    /* Like the USB pipes, a short buffer is an overrun, not a short event. */
+    return buf && event->len > buf_size ? kIOReturnOverrun : kIOReturnSuccess;
+}
+
+void RtlSimController::
+handleDownload(const HciCommandHdr *cmd, RtlSimEventQueue *queue)
+{
+    rtl_download_response resp;
+    uint32_t expected = m_nextFragment > 0x7f ? (m_nextFragment & 0x7f) + 1 : m_nextFragment;
+    uint32_t frag_len = cmd->len ? cmd->len - 1 : 0;
+
+    resp.index = cmd->len ? cmd->data[0] : 0;
+    if (cmd->len == 0 || (cmd->data[0] & 0x7f) != expected) {
+        XYLog("%s out of order fragment 0x%02x, expected 0x%02x\n", __FUNCTION__, resp.index, expected);
+        resp.status = RTL_SIM_STATUS_INVALID_PARAMS;
+        m_nextFragment = 0;
+        queueCommandComplete(queue, HCI_OP_RTL_DOWNLOAD_FW, &resp, sizeof(resp));
+        return;
+    }
+
+    /*
+     * Keep the trailing bytes of the stream: fw_version ends the patch,
+     * which is either the end of the stream or right before the magic of
+     * an appended config blob.
+     */
+    for (uint32_t i = 0; i < frag_len; i++) {
+        memmove(m_lastFragmentTail, m_lastFragmentTail + 1, sizeof(m_lastFragmentTail) - 1);
+        m_lastFragmentTail[sizeof(m_lastFragmentTail) - 1] = cmd->data[1 + i];
+        if (OSReadLittleInt32(m_lastFragmentTail, 4) == RTL_CONFIG_MAGIC) {
+            m_configVersion = OSReadLittleInt32(m_lastFragmentTail, 0);
+            m_sawConfig = true;
+        }
+    }
+    m_downloadedBytes += frag_len;
+    m_downloadedFragments++;
+    m_nextFragment++;
+
+    if (cmd->data[0] & 0x80) {
+        m_patched = true;
+        m_patchVersion = m_sawConfig ? m_configVersion : OSReadLittleInt32(m_lastFragmentTail, 4);
+        m_sawConfig = false;
+        m_nextFragment = 0;
+    }
+    resp.status = RTL_SIM_STATUS_SUCCESS;
+    queueCommandComplete(queue, HCI_OP_RTL_DOWNLOAD_FW, &resp, sizeof(resp));
+}
+
+void RtlSimController::
+handleCommand(const HciCommandHdr *cmd, RtlSimEventQueue *queue)
+{
+    uint16_t opcode = OSSwapLittleToHostInt16(cmd->opcode);
+    uint8_t status;
+
+    m_commandCount++;
+    if (queue->count >= m_commandCredits) {
+        m_creditViolations++;
+    }
+    switch (opcode) {
+        case HCI_OP_READ_LOCAL_VERSION: {
+            hci_rp_read_local_version rp;
+            memset(&rp, 0, sizeof(rp));
+            rp.hci_ver = m_hciVer;
+            rp.lmp_ver = m_hciVer;
+            rp.manufacturer = OSSwapHostToLittleInt16(0x005d);
+            /* Once patched the controller reports the firmware version instead of the ROM identity. */
+            rp.hci_rev = OSSwapHostToLittleInt16(m_patched ? (uint16_t)(m_patchVersion >> 16) : m_hciRev);
+            rp.lmp_subver = OSSwapHostToLittleInt16(m_patched ? (uint16_t)m_patchVersion : m_lmpSubversion);
+            queueCommandComplete(queue, opcode, &rp, sizeof(rp));
+            break;
+        }
+        case HCI_OP_RTL_READ_ROM_VERSION: {
+            rtl_rom_version_evt rp;
+            rp.status = RTL_SIM_STATUS_SUCCESS;
+            rp.version = m_romVersion;
+            queueCommandComplete(queue, opcode, &rp, sizeof(rp));
+            break;
+        }
+        case HCI_OP_RTL_DOWNLOAD_FW:
+            handleDownload(cmd, queue);
+            break;
+        case HCI_OP_RTL_WRITE_DDC:
+            status = RTL_SIM_STATUS_SUCCESS;
+            queueCommandComplete(queue, opcode, &status, sizeof(status));
+            break;
+        case HCI_OP_RTL_READ_REG: {
+            uint8_t rp[5] = { RTL_SIM_STATUS_SUCCESS, 0, 0, 0, 0 };
+            queueCommandComplete(queue, opcode, rp, sizeof(rp));
+            break;
+        }
+        default:
+            status = RTL_SIM_STATUS_UNKNOWN_COMMAND;
+            queueCommandComplete(queue, opcode, &status, sizeof(status));
+            break;
+    }
+}
+
+bool RtlSimController::
+injectEvent(const void *event, uint32_t len)
+{
+    if (len > RTL_SIM_EVENT_MAX_SIZE || m_intrQueue.count == RTL_SIM_EVENT_QUEUE_LEN) {
+        return false;
+    }
+    RtlSimEvent *slot = &m_intrQueue.events[(m_intrQueue.head + m_intrQueue.count) % RTL_SIM_EVENT_QUEUE_LEN];
+    memcpy(slot->data, event, len);
+    slot->len = len;
+    slot->readyNs = m_clockNs;
+    m_intrQueue.count++;
+    return true;
+}
+
+IOReturn RtlSimController::
+sendHCIRequest(HciCommandHdr *cmd, uint32_t timeout)
+{
+    (void)timeout;
+    chargeTransfer(m_latency.controlNs, HCI_COMMAND_HDR_SIZE + cmd->len);
+    handleCommand(cmd, &m_intrQueue);
+    return kIOReturnSuccess;
+}
+
+IOReturn RtlSimController::
+interruptPipeRead(void *buf, uint32_t buf_size, uint32_t *size, uint32_t timeout)
+{
+    if (m_intrQueue.count == 0) {
+        m_clockNs += (uint64_t)timeout * 1000000;
+    }
+    return popEvent(&m_intrQueue, buf, buf_size, size);
+}
+
+IOReturn RtlSimController::
+bulkWrite(const void *data, uint32_t length, uint32_t timeout)
+{
+    const HciCommandHdr *cmd = (const HciCommandHdr *)data;
+    (void)timeout;
+    if (length < (uint32_t)HCI_COMMAND_HDR_SIZE || length != (uint32_t)HCI_COMMAND_HDR_SIZE + cmd->len) {
+        return kIOReturnBadArgument;
+    }
+    chargeTransfer(0, length);
+    handleCommand(cmd, &m_bulkQueue);
+    return kIOReturnSuccess;
+}
+
+void *RtlSimController::
+acquireBulkBuffer(uint32_t *capacity)
+{
+    if (m_bulkBufferBusy) {
+        *capacity = 0;
+        return NULL;
+    }
+    m_bulkBufferBusy = true;
+    *capacity = sizeof(m_bulkBuffer);
+    return m_bulkBuffer;
+}
+
+IOReturn RtlSimController::
+submitBulkBuffer(void *bytes, uint32_t length, uint32_t timeout)
+{
+    IOReturn ret;
+
+    if (bytes != m_bulkBuffer || !m_bulkBufferBusy) {
+        return kIOReturnBadArgument;
+    }
+    ret = length <= sizeof(m_bulkBuffer) ? bulkWrite(bytes, length, timeout) : kIOReturnBadArgument;
+    m_bulkBufferBusy = false;
+    return ret;
+}
+
+void RtlSimController::
+releaseBulkBuffer(void *bytes)
+{
+    if (bytes == m_bulkBuffer) {
+        m_bulkBufferBusy = false;
+    }
+}
+
+IOReturn RtlSimController::
+bulkPipeRead(void *buf, uint32_t buf_size, uint32_t *size, uint32_t timeout)
+{
+    (void)timeout;
+    return popEvent(&m_bulkQueue, buf, buf_size, size);
+}
+
+IOReturn RtlSimController::
+bulkReadPooled(void **bytes, uint32_t *size, uint32_t timeout)
+{
+    IOReturn ret;
+
+    (void)timeout;
+    *bytes = NULL;
+    if (m_bulkReadBusy) {
+        return kIOReturnNoResources;
+    }
+    if ((ret = popEvent(&m_bulkQueue, m_bulkReadBuffer, sizeof(m_bulkReadBuffer), size)) == kIOReturnSuccess) {
+        m_bulkReadBusy = true;
+        *bytes = m_bulkReadBuffer;
+    }
+    return ret;
+}
+
+void RtlSimController::
+releaseBulkReadBuffer(void *bytes)
+{
+    if (bytes == m_bulkReadBuffer) {
+        m_bulkReadBusy = false;
+    }
+}
+
+const char* RtlSimController::
+stringFromReturn(IOReturn code)
+{
+    switch (code) {
+        case kIOReturnSuccess:
+            return "success";
+        case kIOReturnTimeout:
+            return "timeout";
+        case kIOReturnBadArgument:
+            return "bad argument";
+        default:
+            return "error";
+    }
+}
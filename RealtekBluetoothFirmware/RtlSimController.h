@@ -0,0 +1,149 @@
+//
+//  RtlSimController.h
+//  RtlBluetoothFirmware
+//
+//  Software model of a Realtek USB controller in its ROM bootloader state.
+//  Answers READ_LOCAL_VERSION, the 0xfc6d ROM version query, 0xfc20 patch
+//  download and 0xfc8b DDC writes with Command Complete events, so the
+//  RtlCore pipeline can be exercised and timed without hardware.
+//
+
+#ifndef RtlSimController_h
+#define RtlSimController_h
+
+#include "RtlTransport.h"
+
+#define RTL_SIM_EVENT_QUEUE_LEN 8
+#define RTL_SIM_EVENT_MAX_SIZE  (HCI_EVENT_HDR_SIZE + 255)
+#define RTL_SIM_BULK_BUFFER_SIZE (HCI_COMMAND_HDR_SIZE + 255)
+
+typedef struct {
+    uint16_t    len;
+    uint64_t    readyNs;    // simulated time the controller has the event out
+    uint8_t     data[RTL_SIM_EVENT_MAX_SIZE];
+} RtlSimEvent;
+
+typedef struct {
+    RtlSimEvent events[RTL_SIM_EVENT_QUEUE_LEN];
+    uint32_t    head;
+    uint32_t    count;
+} RtlSimEventQueue;
+
+/*
+ * Bus and controller timing, charged to a simulated clock instead of
+ * slept, so bring-up runs can be timed deterministically.
+ */
+typedef struct {
+    uint32_t    controlNs;              // one control transfer, setup to status
+    uint32_t    interruptIntervalNs;    // interrupt endpoint polling interval
+    uint32_t    byteNs;                 // wire time per transferred byte
+    uint32_t    commandNs;              // controller time per command
+    uint32_t    downloadNs;             // controller time per patch fragment
+} RtlSimLatency;
+
+/* USB 1.1 full speed (1 ms frames), the usual Realtek dongle. */
+extern const RtlSimLatency rtlSimLatencyFullSpeed;
+
+/* USB 2.0 high speed (125 us microframes), combo modules. */
+extern const RtlSimLatency rtlSimLatencyHighSpeed;
+
+class RtlSimController : public RtlTransport {
+public:
+    RtlSimController(uint16_t lmpSubversion, uint16_t hciRev, uint8_t hciVer, uint8_t romVersion);
+
+    virtual IOReturn sendHCIRequest(HciCommandHdr *cmd, uint32_t timeout) override;
+
+    virtual IOReturn interruptPipeRead(void *buf, uint32_t buf_size, uint32_t *size, uint32_t timeout) override;
+
+    virtual IOReturn bulkWrite(const void *data, uint32_t length, uint32_t timeout) override;
+
+    /* A single bulk-OUT buffer, lent out one command at a time. */
+    virtual void *acquireBulkBuffer(uint32_t *capacity) override;
+
+    virtual IOReturn submitBulkBuffer(void *bytes, uint32_t length, uint32_t timeout) override;
+
+    virtual void releaseBulkBuffer(void *bytes) override;
+
+    bool bulkBufferLent() const { return m_bulkBufferBusy; }
+
+    /* Bulk-IN events are read in place from a single buffer as well. */
+    virtual IOReturn bulkReadPooled(void **bytes, uint32_t *size, uint32_t timeout) override;
+
+    virtual void releaseBulkReadBuffer(void *bytes) override;
+
+    bool bulkReadBufferLent() const { return m_bulkReadBusy; }
+
+    virtual IOReturn bulkPipeRead(void *buf, uint32_t buf_size, uint32_t *size, uint32_t timeout) override;
+
+    virtual const char* stringFromReturn(IOReturn code) override;
+
+    /* Drop back to the unpatched ROM state, as after a cold power cycle. */
+    void powerCycle();
+
+    bool isPatched() const { return m_patched; }
+
+    uint32_t downloadedBytes() const { return m_downloadedBytes; }
+
+    uint32_t downloadedFragments() const { return m_downloadedFragments; }
+
+    uint32_t commandCount() const { return m_commandCount; }
+
+    /* Commands the controller accepts before their completions are read. */
+    void setCommandCredits(uint8_t credits) { m_commandCredits = credits; }
+
+    /* Commands that arrived while the host had no credit left. */
+    uint32_t creditViolations() const { return m_creditViolations; }
+
+    /* NULL, the default, makes every transfer instantaneous. */
+    void setLatencyModel(const RtlSimLatency *model, uint32_t seed = 1);
+
+    uint64_t elapsedNs() const { return m_clockNs; }
+
+    /* Queue an unsolicited event ahead of whatever the next command answers. */
+    bool injectEvent(const void *event, uint32_t len);
+
+private:
+    void handleCommand(const HciCommandHdr *cmd, RtlSimEventQueue *queue);
+
+    void handleDownload(const HciCommandHdr *cmd, RtlSimEventQueue *queue);
+
+    void queueCommandComplete(RtlSimEventQueue *queue, uint16_t opcode, const void *param, uint8_t plen);
+
+    IOReturn popEvent(RtlSimEventQueue *queue, void *buf, uint32_t buf_size, uint32_t *size);
+
+    void chargeTransfer(uint32_t setupNs, uint32_t bytes);
+
+    uint32_t pollPhase();
+
+private:
+    uint16_t m_lmpSubversion;
+    uint16_t m_hciRev;
+    uint8_t  m_hciVer;
+    uint8_t  m_romVersion;
+
+    bool     m_patched;
+    uint32_t m_patchVersion;
+    uint32_t m_nextFragment;
+    uint32_t m_downloadedBytes;
+    uint32_t m_downloadedFragments;
+    uint32_t m_commandCount;
+    uint8_t  m_commandCredits;
+    uint32_t m_creditViolations;
+    uint8_t  m_lastFragmentTail[8];
+    bool     m_sawConfig;
+    uint32_t m_configVersion;
+    uint8_t  m_bulkBuffer[RTL_SIM_BULK_BUFFER_SIZE];
+    bool     m_bulkBufferBusy;
+    uint8_t  m_bulkReadBuffer[RTL_SIM_EVENT_MAX_SIZE];
+    bool     m_bulkReadBusy;
+
+    RtlSimLatency m_latency;
+    uint64_t m_clockNs;
+    uint64_t m_busyUntilNs;
+    uint32_t m_rng;
+
+    RtlSimEventQueue m_intrQueue;
+    RtlSimEventQueue m_bulkQueue;
+};
+
+#endif /* RtlSimController_h */
@@ -0,0 +1,176 @@
+//
+//  RtlSnoop.cpp
+//  RtlBluetoothFirmware
+//
+//  btsnoop capture, see RtlSnoop.h.
+//
+
+#include "RtlSnoop.h"
+#include "Log.h"
+
+#define BTSNOOP_VERSION         1
+#define BTSNOOP_DATALINK_H4     1002
+#define BTSNOOP_HEADER_SIZE     16
+#define BTSNOOP_RECORD_SIZE     24
+#define BTSNOOP_FLAG_RECEIVED   0x01
+#define BTSNOOP_FLAG_CONTROL    0x02    // command or event rather than data
+
+/* btsnoop timestamps count microseconds from 0000-01-01. */
+#define BTSNOOP_EPOCH_DELTA_US  0x00dcddb30f2f8000ULL
+
+static const uint8_t btsnoopMagic[8] = { 'b', 't', 's', 'n', 'o', 'o', 'p', 0 };
+
+static inline void
+writeBE32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+RtlSnoop::
+RtlSnoop()
+: m_pLock(NULL), m_pBuffer(NULL), m_capacity(0), m_used(0), m_drained(0), m_drops(0),
+  m_flushThreshold(0), m_flushPending(false), m_draining(false), m_flushHandler(NULL), m_flushContext(NULL)
+{
+}
+
+RtlSnoop::
+~RtlSnoop()
+{
+    stop();
+}
+
+bool RtlSnoop::
+start(uint32_t capacity, RtlSnoopFlushHandler handler, void *context, uint32_t flushThreshold)
+{
+    uint8_t *buffer;
+
+    if (m_pBuffer || capacity < BTSNOOP_HEADER_SIZE) {
+        return false;
+    }
+    if (!m_pLock && !(m_pLock = IOLockAlloc())) {
+        return false;
+    }
+    buffer = (uint8_t *)IOMalloc(capacity);
+    if (!buffer) {
+        XYLog("Failed to allocate %d bytes for HCI capture\n", capacity);
+        return false;
+    }
+    memcpy(buffer, btsnoopMagic, sizeof(btsnoopMagic));
+    writeBE32(buffer + 8, BTSNOOP_VERSION);
+    writeBE32(buffer + 12, BTSNOOP_DATALINK_H4);
+
+    IOLockLock(m_pLock);
+    m_capacity = capacity;
+    m_used = BTSNOOP_HEADER_SIZE;
+    m_drained = 0;
+    m_drops = 0;
+    m_flushThreshold = flushThreshold;
+    m_flushPending = false;
+    m_draining = false;
+    m_flushHandler = handler;
+    m_flushContext = context;
+    m_pBuffer = buffer;
+    IOLockUnlock(m_pLock);
+    XYLog("HCI capture started, %d bytes\n", capacity);
+    return true;
+}
+
+void RtlSnoop::
+stop()
+{
+    uint8_t *buffer;
+
+    if (!m_pLock) {
+        return;
+    }
+    IOLockLock(m_pLock);
+    buffer = m_pBuffer;
+    m_pBuffer = NULL;
+    IOLockUnlock(m_pLock);
+    if (buffer) {
+        IOFree(buffer, m_capacity);
+        if (m_drops) {
+            XYLog("HCI capture dropped %d packets\n", m_drops);
+        }
+    }
+    IOLockFree(m_pLock);
+    m_pLock = NULL;
+}
+
+void RtlSnoop::
+append(uint8_t type, bool received, const void *data, uint32_t len)
+{
+    uint64_t ts = RtlWallClockUs() + BTSNOOP_EPOCH_DELTA_US;
+    uint32_t flags = (received ? BTSNOOP_FLAG_RECEIVED : 0) |
+                     (type == RTL_SNOOP_H4_ACL ? 0 : BTSNOOP_FLAG_CONTROL);
+    bool flush = false;
+    uint8_t *rec;
+
+    IOLockLock(m_pLock);
+    if (!m_pBuffer) {
+        IOLockUnlock(m_pLock);
+        return;
+    }
+    if (m_capacity - m_used < BTSNOOP_RECORD_SIZE + 1 + len) {
+        m_drops++;
+        IOLockUnlock(m_pLock);
+        return;
+    }
+    rec = m_pBuffer + m_used;
+    writeBE32(rec, len + 1);
+    writeBE32(rec + 4, len + 1);
+    writeBE32(rec + 8, flags);
+    writeBE32(rec + 12, m_drops);
+    writeBE32(rec + 16, (uint32_t)(ts >> 32));
+    writeBE32(rec + 20, (uint32_t)ts);
+    rec[BTSNOOP_RECORD_SIZE] = type;
+    memcpy(rec + BTSNOOP_RECORD_SIZE + 1, data, len);
+    m_used += BTSNOOP_RECORD_SIZE + 1 + len;
+    if (m_flushHandler && !m_flushPending && m_used - m_drained >= m_flushThreshold) {
+        m_flushPending = flush = true;
+    }
+    IOLockUnlock(m_pLock);
+
+    if (flush) {
+        m_flushHandler(m_flushContext);
+    }
+}
+
+void RtlSnoop::
+drain(RtlSnoopSink sink, void *context)
+{
+    uint32_t start, end;
+
+    if (!m_pLock) {
+        return;
+    }
+    IOLockLock(m_pLock);
+    m_flushPending = false;
+    if (!m_pBuffer || m_draining) {
+        IOLockUnlock(m_pLock);
+        return;
+    }
+    m_draining = true;
+    start = m_drained;
+    end = m_used;
+    IOLockUnlock(m_pLock);
+
+    /* Bytes below m_used are not rewritten while draining, so they are read unlocked. */
+    if (end > start) {
+        sink(context, m_pBuffer + start, end - start);
+    }
+
+    IOLockLock(m_pLock);
+    if (m_used == end) {
+        /* Nothing came in meanwhile: start over from the beginning. */
+        m_used = 0;
+        m_drained = 0;
+    } else {
+        m_drained = end;
+    }
+    m_draining = false;
+    IOLockUnlock(m_pLock);
+}
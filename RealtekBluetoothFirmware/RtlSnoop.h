@@ -0,0 +1,79 @@
+//
+//  RtlSnoop.h
+//  RtlBluetoothFirmware
+//
+//  Optional HCI capture in btsnoop format (datalink 1002, H4 framing), the
+//  format Wireshark, btmon and the Android tools read. Records are appended
+//  to a buffer allocated when capture starts. A flush handler is asked to
+//  drain it from its own context once enough has piled up, so the I/O path
+//  only ever does a copy, and the buffer starts over once drained, so it
+//  only has to hold what arrives between two flushes. With capture off,
+//  record() is a single branch.
+//
+
+#ifndef RtlSnoop_h
+#define RtlSnoop_h
+
+#include "RtlPlatform.h"
+
+#define RTL_SNOOP_H4_COMMAND    0x01
+#define RTL_SNOOP_H4_ACL        0x02
+#define RTL_SNOOP_H4_EVENT      0x04
+
+/* Asks for drain() to be called soon, from a context that may block. */
+typedef void (*RtlSnoopFlushHandler)(void *context);
+
+/* Receives the next chunk of the btsnoop file. */
+typedef void (*RtlSnoopSink)(void *context, const uint8_t *data, uint32_t len);
+
+class RtlSnoop {
+public:
+    RtlSnoop();
+
+    ~RtlSnoop();
+
+    /*
+     * Allocate capacity bytes and start capturing. handler, if set, is
+     * called once flushThreshold bytes are waiting to be drained.
+     */
+    bool start(uint32_t capacity, RtlSnoopFlushHandler handler, void *context, uint32_t flushThreshold);
+
+    void stop();
+
+    bool active() const { return m_pBuffer != NULL; }
+
+    /* H4 packet type, direction and the packet without its H4 byte. */
+    inline void record(uint8_t type, bool received, const void *data, uint32_t len)
+    {
+        if (__builtin_expect(m_pBuffer != NULL, 0)) {
+            append(type, received, data, len);
+        }
+    }
+
+    /*
+     * Hand everything captured since the last drain to sink. Concurrent
+     * calls return at once, the one running already picks their data up.
+     */
+    void drain(RtlSnoopSink sink, void *context);
+
+    /* Packets that did not fit once the buffer filled up. */
+    uint32_t drops() const { return m_drops; }
+
+private:
+    void append(uint8_t type, bool received, const void *data, uint32_t len);
+
+private:
+    IOLock                  *m_pLock;
+    uint8_t * volatile      m_pBuffer;
+    uint32_t                m_capacity;
+    uint32_t                m_used;
+    uint32_t                m_drained;
+    uint32_t                m_drops;
+    uint32_t                m_flushThreshold;
+    bool                    m_flushPending;
+    bool                    m_draining;
+    RtlSnoopFlushHandler    m_flushHandler;
+    void                    *m_flushContext;
+};
+
+#endif /* RtlSnoop_h */
@@ -0,0 +1,117 @@
+//
+//  RtlTrace.cpp
+//  RtlBluetoothFirmware
+//
+//  Binary trace ring and its decoder, see RtlTrace.h.
+//
+
+#include "RtlTrace.h"
+#include "Log.h"
+
+/* Decoder table, in RtlTraceId order; every argument is a uint32_t. */
+static const char *const rtlTraceFormats[RTL_TRACE_ID_COUNT] = {
+    "cmd 0x%04x submitted, plen %u, credits %u",
+    "cmd 0x%04x completed, status 0x%02x, credits %u",
+    "queued cmd 0x%04x failed, status 0x%02x",
+    "unexpected completion for 0x%04x, status 0x%02x",
+    "interrupt read failed: 0x%08x",
+    "event 0x%02x queued, len %u, %u queued",
+    "event queue full, dropped event 0x%02x",
+    "fragment %u index 0x%02x len %u",
+    "V2 subsection opcode %u eco 0x%02x prio %u len %u",
+};
+
+static const char *const rtlTraceLevels[] = { "?", "E", "I", "D" };
+
+RtlTraceRing::
+RtlTraceRing()
+: m_next(0)
+{
+    memset(m_records, 0, sizeof(m_records));
+}
+
+void RtlTraceRing::
+record(uint8_t level, uint16_t id, uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3)
+{
+    uint32_t claim = __atomic_fetch_add(&m_next, 1, __ATOMIC_RELAXED);
+    RtlTraceRecord *rec = &m_records[claim & (RTL_TRACE_RING_SIZE - 1)];
+
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    rec->level = level;
+    rec->id = id;
+    rec->timestampNs = RtlMonotonicNs();
+    rec->args[0] = a0;
+    rec->args[1] = a1;
+    rec->args[2] = a2;
+    rec->args[3] = a3;
+    __atomic_store_n(&rec->seq, claim + 1, __ATOMIC_RELEASE);
+}
+
+/* Copy one record, failing if it was overwritten or is still being written. */
+bool RtlTraceRing::
+readRecord(uint32_t claim, RtlTraceRecord *out)
+{
+    const RtlTraceRecord *rec = &m_records[claim & (RTL_TRACE_RING_SIZE - 1)];
+
+    if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != claim + 1) {
+        return false;
+    }
+    memcpy(out, rec, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&rec->seq, __ATOMIC_RELAXED) == claim + 1;
+}
+
+uint32_t RtlTraceRing::
+firstClaim(uint32_t next, uint32_t max)
+{
+    uint32_t count = next < RTL_TRACE_RING_SIZE ? next : RTL_TRACE_RING_SIZE;
+    if (max && max < count) {
+        count = max;
+    }
+    return next - count;
+}
+
+uint32_t RtlTraceRing::
+copyRecords(RtlTraceRecord *out, uint32_t max)
+{
+    uint32_t next = __atomic_load_n(&m_next, __ATOMIC_ACQUIRE);
+    uint32_t copied = 0;
+
+    for (uint32_t claim = firstClaim(next, max); claim != next && copied < max; claim++) {
+        if (readRecord(claim, &out[copied])) {
+            copied++;
+        }
+    }
+    return copied;
+}
+
+int RtlTraceRing::
+format(const RtlTraceRecord *record, char *buf, size_t len)
+{
+    if (record->id >= RTL_TRACE_ID_COUNT || !rtlTraceFormats[record->id]) {
+        return snprintf(buf, len, "unknown trace id %u", record->id);
+    }
+    return snprintf(buf, len, rtlTraceFormats[record->id],
+                    record->args[0], record->args[1], record->args[2], record->args[3]);
+}
+
+void RtlTraceRing::
+dump(uint32_t max)
+{
+    uint32_t next = __atomic_load_n(&m_next, __ATOMIC_ACQUIRE);
+    RtlTraceRecord record;
+    char text[96];
+
+    XYLog("Trace: %u records, showing the last %u\n", next,
+          next - firstClaim(next, max));
+    for (uint32_t claim = firstClaim(next, max); claim != next; claim++) {
+        if (!readRecord(claim, &record)) {
+            continue;
+        }
+        format(&record, text, sizeof(text));
+        XYLog("[%llu.%06llu] %s %s\n", (unsigned long long)(record.timestampNs / 1000000000ULL),
+              (unsigned long long)(record.timestampNs / 1000 % 1000000ULL),
+              rtlTraceLevels[record.level < 4 ? record.level : 0], text);
+    }
+}
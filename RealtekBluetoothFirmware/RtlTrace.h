@@ -0,0 +1,96 @@
+//
+//  RtlTrace.h
+//  RtlBluetoothFirmware
+//
+//  Per-controller binary trace ring for the hot paths (commands, events,
+//  fragments). A record is an event ID plus up to four 32-bit arguments,
+//  claimed with one atomic add and published by writing its sequence
+//  number last, so recording never takes a lock or formats anything.
+//  Records are rendered to text only when the ring is dumped.
+//
+
+#ifndef RtlTrace_h
+#define RtlTrace_h
+
+#include "RtlPlatform.h"
+
+#define RTL_TRACE_ERROR     1
+#define RTL_TRACE_INFO      2
+#define RTL_TRACE_DEBUG     3
+
+/* Records above this level are compiled out. */
+#ifndef RTL_TRACE_LEVEL
+#ifdef DEBUG
+#define RTL_TRACE_LEVEL     RTL_TRACE_DEBUG
+#else
+#define RTL_TRACE_LEVEL     RTL_TRACE_INFO
+#endif
+#endif
+
+#define RTL_TRACE_RING_SIZE 256     // power of two
+
+typedef enum {
+    RTL_TRACE_CMD_SUBMIT = 0,
+    RTL_TRACE_CMD_COMPLETE,
+    RTL_TRACE_CMD_FAILED,
+    RTL_TRACE_CMD_UNEXPECTED,
+    RTL_TRACE_READ_FAILED,
+    RTL_TRACE_EVENT_QUEUED,
+    RTL_TRACE_EVENT_DROPPED,
+    RTL_TRACE_FRAGMENT,
+    RTL_TRACE_V2_SUBSECTION,
+    RTL_TRACE_ID_COUNT
+} RtlTraceId;
+
+typedef struct {
+    uint32_t    seq;        // claim number + 1, written last; 0 while being written
+    uint8_t     level;
+    uint8_t     reserved;
+    uint16_t    id;
+    uint64_t    timestampNs;
+    uint32_t    args[4];
+} RtlTraceRecord;
+
+class RtlTraceRing {
+public:
+    RtlTraceRing();
+
+    void record(uint8_t level, uint16_t id, uint32_t a0 = 0, uint32_t a1 = 0, uint32_t a2 = 0, uint32_t a3 = 0);
+
+    /* Copy out up to max complete records, oldest first. */
+    uint32_t copyRecords(RtlTraceRecord *out, uint32_t max);
+
+    /* Log the newest max records (all with 0) through XYLog. */
+    void dump(uint32_t max);
+
+    static int format(const RtlTraceRecord *record, char *buf, size_t len);
+
+private:
+    bool readRecord(uint32_t claim, RtlTraceRecord *out);
+
+    uint32_t firstClaim(uint32_t next, uint32_t max);
+
+private:
+    volatile uint32_t   m_next;
+    RtlTraceRecord      m_records[RTL_TRACE_RING_SIZE];
+};
+
+#if RTL_TRACE_LEVEL >= RTL_TRACE_ERROR
+#define RTL_TRACE_ERR(ring, id, x...)   (ring).record(RTL_TRACE_ERROR, id, ##x)
+#else
+#define RTL_TRACE_ERR(ring, id, x...)   do {} while (0)
+#endif
+
+#if RTL_TRACE_LEVEL >= RTL_TRACE_INFO
+#define RTL_TRACE_INF(ring, id, x...)   (ring).record(RTL_TRACE_INFO, id, ##x)
+#else
+#define RTL_TRACE_INF(ring, id, x...)   do {} while (0)
+#endif
+
+#if RTL_TRACE_LEVEL >= RTL_TRACE_DEBUG
+#define RTL_TRACE_DBG(ring, id, x...)   (ring).record(RTL_TRACE_DEBUG, id, ##x)
+#else
+#define RTL_TRACE_DBG(ring, id, x...)   do {} while (0)
+#endif
+
+#endif /* RtlTrace_h */
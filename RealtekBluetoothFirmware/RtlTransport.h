@@ -0,0 +1,70 @@
+//
+//  RtlTransport.h
+//  RtlBluetoothFirmware
+//
+//  The four primitives the firmware loader needs from the bus. The kext
+//  implements them on top of IOUSBHostPipe (USBDeviceController), host
+//  builds can plug in RtlSimController instead.
+//
+
+#ifndef RtlTransport_h
+#define RtlTransport_h
+
+#include "RtlPlatform.h"
+#include "Hci.h"
+
+/* How the controller is attached, part of its identity (RtlChipId.h). */
+enum RtlBus {
+    RTL_BUS_USB = 1,
+    RTL_BUS_UART = 2,
+};
+
+class RtlTransport {
+public:
+    /* Send an HCI command over the control endpoint. */
+    virtual IOReturn sendHCIRequest(HciCommandHdr *cmd, uint32_t timeout) = 0;
+
+    /* Read one HCI event from the interrupt endpoint. */
+    virtual IOReturn interruptPipeRead(void *buf, uint32_t buf_size, uint32_t *size, uint32_t timeout) = 0;
+
+    virtual IOReturn bulkWrite(const void *data, uint32_t length, uint32_t timeout) = 0;
+
+    /*
+     * Bulk-OUT filled in place: acquireBulkBuffer lends a buffer of the
+     * transport, NULL when none is free, submitBulkBuffer sends length
+     * bytes of it and gives it back, releaseBulkBuffer gives it back
+     * unsent. Without buffers of its own a transport only has bulkWrite.
+     */
+    virtual void *acquireBulkBuffer(uint32_t *capacity) { *capacity = 0; return NULL; }
+
+    virtual IOReturn submitBulkBuffer(void * /* bytes */, uint32_t /* length */, uint32_t /* timeout */)
+    {
+        return kIOReturnUnsupported;
+    }
+
+    virtual void releaseBulkBuffer(void * /* bytes */) {}
+
+    virtual IOReturn bulkPipeRead(void *buf, uint32_t buf_size, uint32_t *size, uint32_t timeout) = 0;
+
+    /*
+     * Bulk-IN without a copy: the data lands in a transport buffer that
+     * is lent to the caller until releaseBulkReadBuffer. Transports
+     * without such buffers only have bulkPipeRead.
+     */
+    virtual IOReturn bulkReadPooled(void **bytes, uint32_t * /* size */, uint32_t /* timeout */)
+    {
+        *bytes = NULL;
+        return kIOReturnUnsupported;
+    }
+
+    virtual void releaseBulkReadBuffer(void * /* bytes */) {}
+
+    virtual const char* stringFromReturn(IOReturn code) = 0;
+
+    virtual RtlBus bus() const { return RTL_BUS_USB; }
+
+protected:
+    ~RtlTransport() {}
+};
+
+#endif /* RtlTransport_h */
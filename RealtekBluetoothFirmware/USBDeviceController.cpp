@@ -13,8 +13,6 @@
 #define super OSObject
 OSDefineMetaClassAndStructors(USBDeviceController, OSObject)
 
-#define kReadBufferSize 4096
-
 bool USBDeviceController::
 init(IOService *client, IOUSBHostDevice *dev)
 {
@@ -26,14 +24,13 @@ init(IOService *client, IOUSBHostDevice *dev)
     if (!_hciLock) {
         return false;
     }
-    mReadBuffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task
-                                                              , kIODirectionIn, kReadBufferSize);
-    if (!mReadBuffer) {
-        XYLog("Fail to alloc read buffer\n");
+    mBulkOutExhausted = 0;
+    mBulkInExhausted = 0;
+    m_pStats = NULL;
+    if (!allocBulkPool(mBulkPool, kBulkOutPoolSize, kBulkOutBufferSize, kIODirectionOut) ||
+        !allocBulkPool(mBulkReadPool, kBulkInPoolSize, kBulkInBufferSize, kIODirectionIn)) {
         return false;
     }
-    
-    mReadBuffer->prepare(kIODirectionIn);
     m_pDevice = dev;
     m_pClient = client;
     return true;
@@ -81,12 +78,13 @@ free()
         OSSafeReleaseNULL(m_pBulkReadPipe);
     }
     if (m_pInterruptReadPipe) {
-        m_pInterruptReadPipe->abort();
+        stopInterruptReader();
         OSSafeReleaseNULL(m_pInterruptReadPipe);
     }
-    if (mReadBuffer) {
-        mReadBuffer->complete(kIODirectionIn);
-        OSSafeReleaseNULL(mReadBuffer);
+    freeBulkPool(mBulkPool, kBulkOutPoolSize, kIODirectionOut);
+    freeBulkPool(mBulkReadPool, kBulkInPoolSize, kIODirectionIn);
+    if (mBulkOutExhausted || mBulkInExhausted) {
+        XYLog("%s bulk pools ran dry: out %d times, in %d times\n", __FUNCTION__, mBulkOutExhausted, mBulkInExhausted);
     }
     if (_hciLock) {
         IOLockFree(_hciLock);
@@ -179,102 +177,281 @@ findPipes()
             }
         }
     }
-    return (m_pInterruptReadPipe != NULL && m_pBulkWritePipe != NULL && m_pBulkReadPipe != NULL);
+    if (m_pInterruptReadPipe == NULL || m_pBulkWritePipe == NULL || m_pBulkReadPipe == NULL) {
+        return false;
+    }
+    return startInterruptReader();
 }
 
 IOReturn USBDeviceController::
-bulkPipeRead(void *buf, uint32_t buf_size, uint32_t *size, uint32_t timeout)
+armInterruptTransfer(InterruptTransfer *transfer)
 {
-    uint32_t actualLength = 0;
-    IOReturn ret = m_pBulkReadPipe->io(mReadBuffer, (uint32_t)mReadBuffer->getLength(), actualLength, timeout);
+    IOReturn ret = m_pInterruptReadPipe->io(transfer->buffer, (uint32_t)transfer->buffer->getLength(), &transfer->completion, 0);
     if (ret == kIOUSBPipeStalled) {
-        m_pBulkReadPipe->clearStall(true);
-        ret = m_pBulkReadPipe->io(mReadBuffer, (uint32_t)mReadBuffer->getLength(), actualLength, timeout);
+        m_pInterruptReadPipe->clearStall(true);
+        if (m_pStats) {
+            m_pStats->countStall();
+            m_pStats->countRetry();
+        }
+        ret = m_pInterruptReadPipe->io(transfer->buffer, (uint32_t)transfer->buffer->getLength(), &transfer->completion, 0);
     }
-    if (ret == kIOReturnSuccess) {
-        if (buf && actualLength > buf_size) {
-            XYLog("%s buf size too small. buflen: %d act: %d\n", __FUNCTION__, buf_size, actualLength);
+    if (ret != kIOReturnSuccess) {
+        XYLog("%s failed: %s %d\n", __FUNCTION__, stringFromReturn(ret), ret);
+    }
+    return ret;
+}
+
+bool USBDeviceController::
+startInterruptReader()
+{
+    mInterruptRingHead = 0;
+    mInterruptRingCount = 0;
+    mInterruptOverruns = 0;
+    mInterruptStopping = false;
+    for (int i = 0; i < kInterruptBufferCount; i++) {
+        InterruptTransfer *transfer = &mInterruptTransfers[i];
+        transfer->controller = this;
+        transfer->errors = 0;
+        transfer->parked = false;
+        transfer->buffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, kIODirectionIn, kInterruptEventMaxSize);
+        if (!transfer->buffer) {
+            XYLog("Fail to alloc interrupt buffer\n");
+            return false;
         }
-        if (buf) {
-            memcpy(buf, mReadBuffer->getBytesNoCopy(), min(actualLength, buf_size));
+        transfer->buffer->prepare(kIODirectionIn);
+        transfer->completion.owner = this;
+        transfer->completion.action = interruptHandler;
+        transfer->completion.parameter = transfer;
+        if (armInterruptTransfer(transfer) != kIOReturnSuccess) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void USBDeviceController::
+stopInterruptReader()
+{
+    IOLockLock(_hciLock);
+    mInterruptStopping = true;
+    IOLockUnlock(_hciLock);
+    m_pInterruptReadPipe->abort(IOUSBHostIOSource::kAbortSynchronous);
+    for (int i = 0; i < kInterruptBufferCount; i++) {
+        InterruptTransfer *transfer = &mInterruptTransfers[i];
+        if (transfer->buffer) {
+            transfer->buffer->complete(kIODirectionIn);
+            OSSafeReleaseNULL(transfer->buffer);
         }
-        if (size) {
-            *size = min(actualLength, buf_size);
+    }
+    if (mInterruptOverruns) {
+        XYLog("%s dropped %d events on a full ring\n", __FUNCTION__, mInterruptOverruns);
+    }
+}
+
+/* For callers that want their own copy; RtlCore reads through bulkReadPooled. */
+IOReturn USBDeviceController::
+bulkPipeRead(void *buf, uint32_t buf_size, uint32_t *size, uint32_t timeout)
+{
+    uint32_t actualLength = 0;
+    void *bytes;
+    IOReturn ret = bulkReadPooled(&bytes, &actualLength, timeout);
+    if (ret != kIOReturnSuccess) {
+        return ret;
+    }
+    if (buf && actualLength > buf_size) {
+        XYLog("%s buf size too small. buflen: %d act: %d\n", __FUNCTION__, buf_size, actualLength);
+        ret = kIOReturnOverrun;
+    }
+    if (buf) {
+        memcpy(buf, bytes, min(actualLength, buf_size));
+    }
+    if (size) {
+        *size = buf ? min(actualLength, buf_size) : actualLength;
+    }
+    releaseBulkReadBuffer(bytes);
+    return ret;
+}
+
+IOReturn USBDeviceController::
+bulkReadInto(IOMemoryDescriptor *buffer, uint32_t *size, uint32_t timeout)
+{
+    uint32_t actualLength = 0;
+    IOReturn ret = m_pBulkReadPipe->io(buffer, (uint32_t)buffer->getLength(), actualLength, timeout);
+    if (ret == kIOUSBPipeStalled) {
+        m_pBulkReadPipe->clearStall(true);
+        if (m_pStats) {
+            m_pStats->countStall();
+            m_pStats->countRetry();
         }
-    } else {
+        ret = m_pBulkReadPipe->io(buffer, (uint32_t)buffer->getLength(), actualLength, timeout);
+    }
+    if (ret != kIOReturnSuccess) {
         XYLog("%s failed: %s %d\n", __FUNCTION__, stringFromReturn(ret), ret);
     }
+    if (size) {
+        *size = ret == kIOReturnSuccess ? actualLength : 0;
+    }
+    return ret;
+}
+
+IOReturn USBDeviceController::
+bulkReadPooled(void **bytes, uint32_t *size, uint32_t timeout)
+{
+    BulkBuffer *entry = takeBulkBuffer(mBulkReadPool, kBulkInPoolSize, &mBulkInExhausted);
+    IOReturn ret;
+    *bytes = NULL;
+    if (!entry) {
+        return kIOReturnNoResources;
+    }
+    if ((ret = bulkReadInto(entry->buffer, size, timeout)) != kIOReturnSuccess) {
+        putBulkBuffer(entry);
+        return ret;
+    }
+    *bytes = entry->buffer->getBytesNoCopy();
     return ret;
 }
 
+void USBDeviceController::
+releaseBulkReadBuffer(void *bytes)
+{
+    BulkBuffer *entry = findBulkBuffer(mBulkReadPool, kBulkInPoolSize, bytes);
+    if (entry) {
+        putBulkBuffer(entry);
+    }
+}
+
 void USBDeviceController::
 interruptHandler(void *owner, void *parameter, IOReturn status, uint32_t bytesTransferred)
 {
     USBDeviceController *controller = OSDynamicCast(USBDeviceController, (OSObject *)owner);
-    if (!controller || !parameter) {
+    InterruptTransfer *transfer = (InterruptTransfer *)parameter;
+    bool rearm = true;
+    if (!controller || !transfer) {
         return;
     }
     switch (status) {
         case kIOReturnSuccess:
+            transfer->errors = 0;
+            break;
+        case kIOReturnAborted:
+        case kIOReturnNoDevice:
+        case kIOReturnNotAttached:
+        case kIOReturnOffline:
+            rearm = false;
             break;
+        case kIOUSBPipeStalled:
         case kIOReturnNotResponding:
             controller->m_pInterruptReadPipe->clearStall(false);
+            if (controller->m_pStats) {
+                controller->m_pStats->countStall();
+            }
+            // fall through
         default:
-            XYLog("%s status: %s (%d) len: %d\n", __FUNCTION__, controller->stringFromReturn(status), status, bytesTransferred);
+            // Logged once per run of errors; one that keeps failing is parked
+            // until the next reader resets the pipe and posts it again
+            if (transfer->errors++ == 0) {
+                XYLog("%s status: %s (%d) len: %d\n", __FUNCTION__, controller->stringFromReturn(status), status, bytesTransferred);
+            }
+            if (transfer->errors > kInterruptMaxErrors) {
+                XYLog("%s parking an interrupt transfer after %d errors\n", __FUNCTION__, transfer->errors);
+                rearm = false;
+            } else if (controller->m_pStats) {
+                controller->m_pStats->countRetry();
+            }
             break;
     }
     
-    InterruptResp *resp = (InterruptResp *)parameter;
-    resp->status = status;
-    resp->dataLen = bytesTransferred;
-    IOLockWakeup(controller->_hciLock, controller, true);
+    IOLockLock(controller->_hciLock);
+    if (status == kIOReturnSuccess && bytesTransferred > 0) {
+        if (controller->mInterruptRingCount == kInterruptRingSize) {
+            controller->mInterruptOverruns++;
+        } else {
+            uint32_t tail = (controller->mInterruptRingHead + controller->mInterruptRingCount) % kInterruptRingSize;
+            InterruptEvent *event = &controller->mInterruptRing[tail];
+            event->dataLen = min(bytesTransferred, (uint32_t)kInterruptEventMaxSize);
+            memcpy(event->data, transfer->buffer->getBytesNoCopy(), event->dataLen);
+            controller->mInterruptRingCount++;
+            IOLockWakeup(controller->_hciLock, controller, true);
+        }
+    }
+    if (controller->mInterruptStopping) {
+        rearm = false;
+    } else if (!rearm && transfer->errors > kInterruptMaxErrors) {
+        transfer->parked = true;
+    }
+    IOLockUnlock(controller->_hciLock);
+    
+    if (rearm) {
+        controller->armInterruptTransfer(transfer);
+    }
+}
+
+/*
+ * Reset the pipe and post again the transfers that were parked after a run
+ * of errors, so a burst of them does not leave the pipe with fewer armed
+ * transfers, or none. Runs on the reader's thread, where it may block.
+ * Posting happens under _hciLock so it cannot race stopInterruptReader.
+ */
+void USBDeviceController::
+rearmParkedTransfers()
+{
+    bool parked = false;
+    
+    IOLockLock(_hciLock);
+    for (int i = 0; i < kInterruptBufferCount; i++) {
+        parked |= mInterruptTransfers[i].parked;
+    }
+    IOLockUnlock(_hciLock);
+    if (!parked) {
+        return;
+    }
+    m_pInterruptReadPipe->clearStall(true);
+    IOLockLock(_hciLock);
+    for (int i = 0; i < kInterruptBufferCount && !mInterruptStopping; i++) {
+        InterruptTransfer *transfer = &mInterruptTransfers[i];
+        if (!transfer->parked) {
+            continue;
+        }
+        transfer->errors = 0;
+        if (armInterruptTransfer(transfer) == kIOReturnSuccess) {
+            transfer->parked = false;
+        }
+    }
+    IOLockUnlock(_hciLock);
 }
 
 IOReturn USBDeviceController::
 interruptPipeRead(void *buf, uint32_t buf_size, uint32_t *size, uint32_t timeout)
 {
     AbsoluteTime deadline;
-    IOUSBHostCompletion comple;
-    InterruptResp interrupResp;
+    InterruptEvent *event;
+    IOReturn ret = kIOReturnSuccess;
     
+    rearmParkedTransfers();
     clock_interval_to_deadline(timeout, kMillisecondScale, reinterpret_cast<uint64_t*> (&deadline));
-    memset(&interrupResp, 0, sizeof(interrupResp));
-    comple.action = interruptHandler;
-    comple.owner = this;
-    comple.parameter = &interrupResp;
     
-    IOReturn ret = m_pInterruptReadPipe->io(mReadBuffer, (uint32_t)mReadBuffer->getLength(), &comple, 0);
-    if (ret == kIOUSBPipeStalled) {
-        m_pInterruptReadPipe->clearStall(true);
-        ret = m_pInterruptReadPipe->io(mReadBuffer, (uint32_t)mReadBuffer->getLength(), &comple, 0);
-    }
-    
-    if (ret == kIOReturnSuccess) {
-        IOLockLock(_hciLock);
+    IOLockLock(_hciLock);
+    while (mInterruptRingCount == 0) {
         if (IOLockSleepDeadline(_hciLock, this, deadline, THREAD_INTERRUPTIBLE) != THREAD_AWAKENED) {
             IOLockUnlock(_hciLock);
-            m_pInterruptReadPipe->abort();
             XYLog("%s Timeout\n", __FUNCTION__);
             return kIOReturnTimeout;
         }
-        if (interrupResp.dataLen <= 0) {
-            IOLockUnlock(_hciLock);
-            XYLog("%s invalid response size: %d\n", __FUNCTION__, interrupResp.dataLen);
-            return kIOReturnError;
-        }
-        if (buf && interrupResp.dataLen > buf_size) {
-            XYLog("%s buf size too small. buflen: %d act: %d\n", __FUNCTION__, buf_size, interrupResp.dataLen);
-        }
-        if (buf) {
-            memcpy(buf, mReadBuffer->getBytesNoCopy(), min(interrupResp.dataLen, buf_size));
-        }
-        if (size) {
-            *size = min(interrupResp.dataLen, buf_size);
-        }
-        IOLockUnlock(_hciLock);
-    } else {
-        XYLog("%s failed: %s %d\n", __FUNCTION__, stringFromReturn(ret), ret);
     }
+    event = &mInterruptRing[mInterruptRingHead];
+    if (buf && event->dataLen > buf_size) {
+        XYLog("%s buf size too small. buflen: %d act: %d\n", __FUNCTION__, buf_size, event->dataLen);
+        ret = kIOReturnOverrun;
+    }
+    if (buf) {
+        memcpy(buf, event->data, min(event->dataLen, buf_size));
+    }
+    if (size) {
+        *size = buf ? min(event->dataLen, buf_size) : event->dataLen;
+    }
+    mInterruptRingHead = (mInterruptRingHead + 1) % kInterruptRingSize;
+    mInterruptRingCount--;
+    IOLockUnlock(_hciLock);
     return ret;
 }
 
@@ -294,9 +471,126 @@ sendHCIRequest(HciCommandHdr *cmd, uint32_t timeout)
     return m_pInterface->deviceRequest(request, cmd, actualLength, timeout);
 }
 
+bool USBDeviceController::
+allocBulkPool(BulkBuffer *pool, int count, uint32_t size, IODirection direction)
+{
+    for (int i = 0; i < count; i++) {
+        BulkBuffer *entry = &pool[i];
+        entry->buffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, direction, size);
+        if (!entry->buffer) {
+            XYLog("Fail to alloc bulk buffer\n");
+            return false;
+        }
+        if (entry->buffer->prepare(direction) != kIOReturnSuccess) {
+            XYLog("Fail to prepare bulk buffer\n");
+            OSSafeReleaseNULL(entry->buffer);
+            return false;
+        }
+        entry->busy = false;
+    }
+    return true;
+}
+
+void USBDeviceController::
+freeBulkPool(BulkBuffer *pool, int count, IODirection direction)
+{
+    for (int i = 0; i < count; i++) {
+        BulkBuffer *entry = &pool[i];
+        if (entry->buffer) {
+            entry->buffer->complete(direction);
+            OSSafeReleaseNULL(entry->buffer);
+        }
+    }
+}
+
+BulkBuffer *USBDeviceController::
+takeBulkBuffer(BulkBuffer *pool, int count, uint32_t *exhausted)
+{
+    BulkBuffer *entry = NULL;
+    IOLockLock(_hciLock);
+    for (int i = 0; i < count; i++) {
+        if (pool[i].buffer && !pool[i].busy) {
+            entry = &pool[i];
+            entry->busy = true;
+            break;
+        }
+    }
+    if (!entry) {
+        (*exhausted)++;
+    }
+    IOLockUnlock(_hciLock);
+    return entry;
+}
+
+BulkBuffer *USBDeviceController::
+findBulkBuffer(BulkBuffer *pool, int count, void *bytes)
+{
+    for (int i = 0; i < count; i++) {
+        if (pool[i].buffer && pool[i].buffer->getBytesNoCopy() == bytes) {
+            return &pool[i];
+        }
+    }
+    return NULL;
+}
+
+void USBDeviceController::
+putBulkBuffer(BulkBuffer *entry)
+{
+    IOLockLock(_hciLock);
+    entry->busy = false;
+    IOLockUnlock(_hciLock);
+}
+
+void *USBDeviceController::
+acquireBulkBuffer(uint32_t *capacity)
+{
+    BulkBuffer *entry = takeBulkBuffer(mBulkPool, kBulkOutPoolSize, &mBulkOutExhausted);
+    if (capacity) {
+        *capacity = entry ? kBulkOutBufferSize : 0;
+    }
+    return entry ? entry->buffer->getBytesNoCopy() : NULL;
+}
+
+void USBDeviceController::
+releaseBulkBuffer(void *bytes)
+{
+    BulkBuffer *entry = findBulkBuffer(mBulkPool, kBulkOutPoolSize, bytes);
+    if (entry) {
+        putBulkBuffer(entry);
+    }
+}
+
+IOReturn USBDeviceController::
+submitBulkBuffer(void *bytes, uint32_t length, uint32_t timeout)
+{
+    BulkBuffer *entry = findBulkBuffer(mBulkPool, kBulkOutPoolSize, bytes);
+    uint32_t actLen = 0;
+    IOReturn ret;
+    if (!entry) {
+        return kIOReturnBadArgument;
+    }
+    if (length > kBulkOutBufferSize) {
+        putBulkBuffer(entry);
+        return kIOReturnBadArgument;
+    }
+    if ((ret = m_pBulkWritePipe->io(entry->buffer, length, actLen, timeout)) != kIOReturnSuccess) {
+        XYLog("Failed to write to bulk pipe (error %d)\n", ret);
+    }
+    putBulkBuffer(entry);
+    return ret;
+}
+
 IOReturn USBDeviceController::
 bulkWrite(const void *data, uint32_t length, uint32_t timeout)
 {
+    uint32_t capacity = 0;
+    void *bytes;
+    if (length <= kBulkOutBufferSize && (bytes = acquireBulkBuffer(&capacity))) {
+        memcpy(bytes, data, length);
+        return submitBulkBuffer(bytes, length, timeout);
+    }
+    
+    /* Oversized write or pool exhausted: wire the caller's memory for this one. */
     IOMemoryDescriptor* buffer = IOMemoryDescriptor::withAddress((void *)data, length, kIODirectionOut);
     if (!buffer) {
         XYLog("Unable to allocate bulk write buffer.\n");
@@ -317,9 +611,8 @@ bulkWrite(const void *data, uint32_t length, uint32_t timeout)
     }
     if ((ret = buffer->complete(kIODirectionOut)) != kIOReturnSuccess) {
         XYLog("Failed to complete bulk write memory buffer (error %d)\n", ret);
-        buffer->release();
-        return ret;
     }
+    buffer->release();
     return ret;
 }
 
@@ -18,13 +18,43 @@
 #include <IOKit/usb/IOUSBHostInterface.h>
 
 #include "Hci.h"
+#include "RtlTransport.h"
+#include "RtlHciStats.h"
 
+#define kInterruptBufferCount   4
+#define kInterruptRingSize      16
+#define kInterruptEventMaxSize  260     // 2 byte header + 255 byte payload
+#define kInterruptMaxErrors     8       // failed completions in a row before a transfer is parked
+
+#define kBulkOutPoolSize        4
+#define kBulkOutBufferSize      1024
+#define kBulkInPoolSize         2
+#define kBulkInBufferSize       4096
+
+class USBDeviceController;
+
+/* One of the transfers kept posted on the interrupt pipe. */
+typedef struct {
+    USBDeviceController *controller;
+    IOBufferMemoryDescriptor *buffer;
+    IOUSBHostCompletion completion;
+    uint32_t errors;    // consecutive failed completions
+    bool parked;        // not posted until the next interruptPipeRead
+} InterruptTransfer;
+
+/* A bulk buffer that stays allocated and prepared for the controller's lifetime. */
+typedef struct {
+    IOBufferMemoryDescriptor *buffer;
+    bool busy;
+} BulkBuffer;
+
+/* An event that completed and is waiting for interruptPipeRead. */
 typedef struct {
-    int status;
     uint32_t dataLen;
-} InterruptResp;
+    uint8_t data[kInterruptEventMaxSize];
+} InterruptEvent;
 
-class USBDeviceController : public OSObject {
+class USBDeviceController : public OSObject, public RtlTransport {
     OSDeclareDefaultStructors(USBDeviceController)
     
 public:
@@ -39,18 +69,64 @@ public:
     
     virtual bool findPipes();
     
-    IOReturn bulkPipeRead(void *buf, uint32_t buf_size, uint32_t *size, uint32_t timeout);
+    virtual IOReturn bulkPipeRead(void *buf, uint32_t buf_size, uint32_t *size, uint32_t timeout) override;
+    
+    virtual IOReturn interruptPipeRead(void *buf, uint32_t buf_size, uint32_t *size, uint32_t timeout) override;
+    
+    virtual IOReturn sendHCIRequest(HciCommandHdr *cmd, uint32_t timeout) override;
+    
+    virtual IOReturn bulkWrite(const void *data, uint32_t length, uint32_t timeout) override;
+    
+    virtual const char* stringFromReturn(IOReturn code) override;
+    
+    /* Bulk-OUT from the pool of prepared buffers, see RtlTransport. */
+    virtual void *acquireBulkBuffer(uint32_t *capacity) override;
+    
+    virtual IOReturn submitBulkBuffer(void *bytes, uint32_t length, uint32_t timeout) override;
+    
+    virtual void releaseBulkBuffer(void *bytes) override;
     
-    IOReturn interruptPipeRead(void *buf, uint32_t buf_size, uint32_t *size, uint32_t timeout);
+    uint32_t bulkOutPoolExhaustions() const { return mBulkOutExhausted; }
     
-    IOReturn sendHCIRequest(HciCommandHdr *cmd, uint32_t timeout);
+    uint32_t bulkInPoolExhaustions() const { return mBulkInExhausted; }
     
-    IOReturn bulkWrite(const void *data, uint32_t length, uint32_t timeout);
+    /*
+     * Zero-copy bulk-IN: the pipe transfers straight into memory the
+     * caller reads from. bulkReadInto takes a descriptor the caller has
+     * already prepared for kIODirectionIn. bulkReadPooled borrows one of
+     * the pooled buffers and hands it over on completion; give it back with
+     * releaseBulkReadBuffer.
+     */
+    virtual IOReturn bulkReadInto(IOMemoryDescriptor *buffer, uint32_t *size, uint32_t timeout);
     
-    const char* stringFromReturn(IOReturn code);
+    virtual IOReturn bulkReadPooled(void **bytes, uint32_t *size, uint32_t timeout) override;
+    
+    virtual void releaseBulkReadBuffer(void *bytes) override;
+    
+    /* Where stalls cleared and retried transfers are counted, may be NULL. */
+    void setStats(RtlHciStats *stats) { m_pStats = stats; }
     
     static void interruptHandler(void *owner, void *parameter, IOReturn status, uint32_t bytesTransferred);
     
+private:
+    bool startInterruptReader();
+    
+    void stopInterruptReader();
+    
+    IOReturn armInterruptTransfer(InterruptTransfer *transfer);
+    
+    void rearmParkedTransfers();
+    
+    bool allocBulkPool(BulkBuffer *pool, int count, uint32_t size, IODirection direction);
+    
+    void freeBulkPool(BulkBuffer *pool, int count, IODirection direction);
+    
+    BulkBuffer *takeBulkBuffer(BulkBuffer *pool, int count, uint32_t *exhausted);
+    
+    BulkBuffer *findBulkBuffer(BulkBuffer *pool, int count, void *bytes);
+    
+    void putBulkBuffer(BulkBuffer *entry);
+    
 private:
     IOUSBHostDevice* m_pDevice;
     IOService*  m_pClient;
@@ -61,7 +137,24 @@ private:
     IOUSBHostPipe* m_pBulkReadPipe;
     
     IOLock *_hciLock;
-    IOBufferMemoryDescriptor* mReadBuffer;
+    RtlHciStats *m_pStats;
+    
+    /*
+     * The interrupt pipe is kept armed with kInterruptBufferCount transfers
+     * so events arriving between two reads are not lost. Completed events
+     * go into the ring under _hciLock and are consumed by interruptPipeRead.
+     */
+    InterruptTransfer mInterruptTransfers[kInterruptBufferCount];
+    InterruptEvent mInterruptRing[kInterruptRingSize];
+    uint32_t mInterruptRingHead;
+    uint32_t mInterruptRingCount;
+    uint32_t mInterruptOverruns;
+    bool mInterruptStopping;
+    
+    BulkBuffer mBulkPool[kBulkOutPoolSize];
+    BulkBuffer mBulkReadPool[kBulkInPoolSize];
+    uint32_t mBulkOutExhausted;
+    uint32_t mBulkInExhausted;
 };
 
 #endif /* USBDeviceController_hpp */
@@ -9,8 +9,11 @@
 #ifndef linux_h
 #define linux_h
 
+#include "RtlPlatform.h"
+#ifdef KERNEL
 #include <IOKit/IOTypes.h>
 #include <libkern/OSAtomic.h>
+#endif
 
 typedef UInt8  u8;
 typedef UInt16 u16;
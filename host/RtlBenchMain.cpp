@@ -0,0 +1,39 @@
+//
+//  RtlBenchMain.cpp
+//  RtlBluetoothFirmware
+//
+//  Host driver of the bring-up benchmark:
+//
+//      RtlBench [full|high] [runs] [p99 budget in us]
+//
+//  Exits non-zero when rtlBenchAll fails, so a CI job can gate on it.
+//
+
+#include "RtlBench.h"
+
+int main(int argc, char **argv)
+{
+    const RtlSimLatency *model = &rtlSimLatencyHighSpeed;
+    uint32_t runs = 20;
+    uint64_t budgetNs = 0;
+
+    if (argc > 1) {
+        if (strcmp(argv[1], "full") == 0) {
+            model = &rtlSimLatencyFullSpeed;
+        } else if (strcmp(argv[1], "high") != 0) {
+            printf("usage: %s [full|high] [runs] [p99 budget in us]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (argc > 2) {
+        runs = (uint32_t)strtoul(argv[2], NULL, 0);
+    }
+    if (argc > 3) {
+        budgetNs = strtoull(argv[3], NULL, 0) * 1000;
+    }
+    if (!runs) {
+        printf("runs must be at least 1\n");
+        return 2;
+    }
+    return rtlBenchAll(model, runs, budgetNs) ? 0 : 1;
+}
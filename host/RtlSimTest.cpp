@@ -0,0 +1,631 @@
+//
+//  RtlSimTest.cpp
+//  RtlBluetoothFirmware
+//
+//  Host test of the firmware loader: RtlCore brings up RtlSimController
+//  with every patch generated from the fixtures of make_fixtures.py, cold
+//  and warm, and must refuse patches whose embedded bytes were corrupted.
+//
+
+#include "RtlCore.h"
+#include "RtlFwStream.h"
+#include "RtlHciStats.h"
+#include "RtlPatchCache.h"
+#include "RtlSimController.h"
+#include "RtlTrace.h"
+#include "FwData.h"
+
+static int gChecks;
+static int gFailures;
+
+#define CHECK(cond) \
+do\
+{\
+gChecks++;\
+if (!(cond)) {\
+printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);\
+gFailures++;\
+}\
+}while(0)
+
+/* A copy of an index entry that reads its stored bytes from var instead. */
+static FwPatchIndex
+rtlTestEntry(const FwPatchIndex *entry, const uint8_t *var, uint32_t crc32c, uint32_t storedCrc32c)
+{
+    const FwDesc *desc = &entry->patch;
+    FwPatchIndex copy = { entry->lmp_subversion, entry->rom_version, entry->project_id, entry->fw_version,
+        entry->config_size, { desc->name, var, desc->size, desc->codec, desc->uncompressed_size, crc32c,
+        storedCrc32c, desc->dict } };
+    return copy;
+}
+
+static bool
+rtlTestSetup(RtlSimController *sim)
+{
+    RtlCore core(sim);
+    return core.setupFirmware();
+}
+
+static void
+testColdBringUp(const FwPatchIndex *entry)
+{
+    const RtlChipId *id = rtlFindChipId(entry->patch.name);
+    RtlPatchCacheStats before, after;
+
+    CHECK(id != NULL);
+    if (!id) {
+        return;
+    }
+    RtlPatchCache::shared()->purge();
+    // Twice, so compressed patches are also sent from the patch cache
+    for (int i = 0; i < 2; i++) {
+        RtlSimController sim(id->lmpSubver, id->hciRev, id->hciVer, entry->rom_version);
+        RtlPatchCache::shared()->getStats(&before);
+        CHECK(rtlTestSetup(&sim));
+        CHECK(sim.isPatched());
+        CHECK(sim.downloadedFragments() > 0);
+        CHECK(sim.downloadedBytes() == (uint32_t)entry->patch.uncompressed_size);
+        CHECK(sim.creditViolations() == 0);
+        RtlPatchCache::shared()->getStats(&after);
+        if (i == 1 && entry->patch.codec != FW_CODEC_NONE) {
+            CHECK(after.hits == before.hits + 1);
+        }
+    }
+}
+
+static void
+testWarmStart(const FwPatchIndex *entry)
+{
+    const RtlChipId *id = rtlFindChipId(entry->patch.name);
+    uint32_t fragments;
+
+    if (!id) {
+        return;
+    }
+    RtlSimController sim(id->lmpSubver, id->hciRev, id->hciVer, entry->rom_version);
+    CHECK(rtlTestSetup(&sim));
+    fragments = sim.downloadedFragments();
+    CHECK(fragments > 0);
+
+    // A driver reload finds the controller running the patch already
+    CHECK(rtlTestSetup(&sim));
+    CHECK(sim.isPatched());
+    CHECK(sim.downloadedFragments() == fragments);
+
+    // After a power cycle it is back in ROM and needs the patch again
+    sim.powerCycle();
+    CHECK(rtlTestSetup(&sim));
+    CHECK(sim.downloadedFragments() == fragments);
+    CHECK(sim.downloadedBytes() == (uint32_t)entry->patch.uncompressed_size);
+}
+
+/*
+ * The one-pass load must fail before anything is sent, and the streamed
+ * download must fail by its last fragment, so the patch never boots.
+ */
+static void
+checkRejected(const FwPatchIndex *entry)
+{
+    const RtlChipId *id = rtlFindChipId(entry->patch.name);
+    RtlSimController sim(id->lmpSubver, id->hciRev, id->hciVer, entry->rom_version);
+    RtlCore core(&sim);
+    RtlFwStream stream;
+    RtlFwPatch patch;
+
+    CHECK(!core.loadIndexedPatch(entry, &patch));
+    CHECK(sim.downloadedFragments() == 0);
+    if (stream.open(&entry->patch)) {
+        CHECK(!core.downloadFirmware(&stream));
+    }
+    CHECK(!sim.isPatched());
+}
+
+static void
+testCorruptPatch(const FwPatchIndex *entry)
+{
+    const FwDesc *desc = &entry->patch;
+    uint32_t size = (uint32_t)desc->size;
+    uint8_t *copy;
+
+    if (!rtlFindChipId(desc->name)) {
+        return;
+    }
+    copy = (uint8_t *)IOMalloc(size);
+    CHECK(copy != NULL);
+    if (!copy) {
+        return;
+    }
+
+    // A flipped bit in the stored bytes
+    memcpy(copy, desc->var, size);
+    copy[size / 2] ^= 0x10;
+    FwPatchIndex flipped = rtlTestEntry(entry, copy, desc->crc32c, desc->stored_crc32c);
+    checkRejected(&flipped);
+
+    // Intact bytes that do not match the recorded checksum of the stored bytes
+    FwPatchIndex storedMismatch = rtlTestEntry(entry, desc->var, desc->crc32c, desc->stored_crc32c ^ 1);
+    checkRejected(&storedMismatch);
+
+    // Decoded bytes that do not match, as a faulty decoder would produce
+    FwPatchIndex decodedMismatch = rtlTestEntry(entry, desc->var, desc->crc32c ^ 1, desc->stored_crc32c);
+    checkRejected(&decodedMismatch);
+
+    IOFree(copy, size);
+}
+
+/* With several credits the fragments are pipelined, never past the credit count. */
+static void
+testPipelinedDownload(const FwPatchIndex *entry, uint8_t credits)
+{
+    const RtlChipId *id = rtlFindChipId(entry->patch.name);
+    RtlSimController sim(id->lmpSubver, id->hciRev, id->hciVer, entry->rom_version);
+
+    sim.setCommandCredits(credits);
+    CHECK(rtlTestSetup(&sim));
+    CHECK(sim.isPatched());
+    CHECK(sim.downloadedBytes() == (uint32_t)entry->patch.uncompressed_size);
+    CHECK(sim.creditViolations() == 0);
+}
+
+/* The resident patch must go out exactly as the streamed one did. */
+static void
+testResidentDownload(const FwPatchIndex *entry)
+{
+    const RtlChipId *id = rtlFindChipId(entry->patch.name);
+    RtlSimController streamedSim(id->lmpSubver, id->hciRev, id->hciVer, entry->rom_version);
+    RtlSimController sim(id->lmpSubver, id->hciRev, id->hciVer, entry->rom_version);
+    RtlCore core(&sim);
+    RtlFwPatch patch;
+
+    CHECK(rtlTestSetup(&streamedSim));
+    CHECK(core.loadIndexedPatch(entry, &patch));
+    CHECK(core.downloadFirmware(&patch));
+    CHECK(sim.isPatched());
+    CHECK(sim.downloadedBytes() == streamedSim.downloadedBytes());
+    CHECK(sim.downloadedFragments() == streamedSim.downloadedFragments());
+    RtlCore::releaseFwPatch(&patch);
+}
+
+/*
+ * A dictionary coded variant must decode to its base with only a few
+ * words changed, both in one shot and when streamed in small reads.
+ */
+static void
+testDictionaryVariant(const FwDesc *desc)
+{
+    RtlSimController sim(0, 0, 0, 0);
+    RtlCore core(&sim);
+    RtlFwData variant, base;
+    RtlFwStream stream;
+    uint8_t chunk[1000];
+    uint32_t diff = 0;
+
+    CHECK(core.getFWDescByName(desc->name, &variant));
+    CHECK(core.getFWDescByName(desc->dict->name, &base));
+    CHECK(variant.length == base.length);
+    for (uint32_t i = 0; i < variant.length && i < base.length; i++) {
+        diff += variant.bytes[i] != base.bytes[i];
+    }
+    CHECK(diff > 0 && diff <= 64);
+    CHECK(stream.open(desc));
+    for (uint32_t offset = 0; offset < variant.length; offset += sizeof(chunk)) {
+        uint32_t len = variant.length - offset < sizeof(chunk) ? variant.length - offset : sizeof(chunk);
+        CHECK(stream.read(chunk, len) && memcmp(chunk, variant.bytes + offset, len) == 0);
+    }
+    RtlCore::releaseFwData(&base);
+    RtlCore::releaseFwData(&variant);
+}
+
+/* Every command of a bring-up is counted once, read timeouts globally. */
+static void
+testHciStats(const FwPatchIndex *entry)
+{
+    const RtlChipId *id = rtlFindChipId(entry->patch.name);
+    RtlSimController sim(id->lmpSubver, id->hciRev, id->hciVer, entry->rom_version);
+    RtlCore core(&sim);
+    RtlHciStatsSnapshot snapshot;
+    uint8_t event[HCI_MAX_EVENT_SIZE];
+    uint32_t commands = 0;
+    uint32_t downloads = 0;
+
+    CHECK(core.setupFirmware());
+    core.stats()->snapshot(&snapshot);
+    for (uint32_t i = 0; i < snapshot.numOpcodes; i++) {
+        const RtlOpcodeStats *op = &snapshot.opcodes[i];
+        uint32_t bucketed = 0;
+
+        for (int b = 0; b < RTL_STATS_BUCKETS; b++) {
+            bucketed += op->buckets[b];
+        }
+        CHECK(bucketed == op->count);
+        CHECK(op->failures == 0);
+        commands += op->count;
+        if (op->opcode == HCI_OP_RTL_DOWNLOAD_FW) {
+            downloads = op->count;
+        }
+    }
+    CHECK(commands + snapshot.untracked == sim.commandCount());
+    CHECK(downloads == sim.downloadedFragments());
+    CHECK(snapshot.timeouts == 0);
+
+    CHECK(!core.waitForEvent(0xff, event, sizeof(event), NULL, 10));
+    core.stats()->snapshot(&snapshot);
+    CHECK(snapshot.timeouts == 1);
+    CHECK(RtlHciStats::bucketFor(0) == 0);
+    CHECK(RtlHciStats::bucketFor(3) == 2);
+    CHECK(RtlHciStats::bucketFor(~0ULL) == RTL_STATS_BUCKETS - 1);
+}
+
+/* The trace ring keeps the newest records, oldest first when copied out. */
+static void
+testTraceRing()
+{
+    static RtlTraceRing ring;
+    static RtlTraceRecord records[RTL_TRACE_RING_SIZE];
+    char text[64];
+    uint32_t count;
+    bool ordered = true;
+
+    for (uint32_t i = 0; i < RTL_TRACE_RING_SIZE + 44; i++) {
+        ring.record(RTL_TRACE_INFO, RTL_TRACE_FRAGMENT, i, 0, 252);
+    }
+    count = ring.copyRecords(records, RTL_TRACE_RING_SIZE);
+    CHECK(count == RTL_TRACE_RING_SIZE);
+    CHECK(records[0].args[0] == 44);
+    CHECK(records[count - 1].args[0] == RTL_TRACE_RING_SIZE + 43);
+    for (uint32_t i = 1; i < count; i++) {
+        ordered = ordered && records[i].seq == records[i - 1].seq + 1;
+    }
+    CHECK(ordered);
+    CHECK(ring.copyRecords(records, 4) == 4 && records[0].args[0] == RTL_TRACE_RING_SIZE + 40);
+    CHECK(RtlTraceRing::format(&records[0], text, sizeof(text)) > 0);
+    records[0].id = RTL_TRACE_ID_COUNT;
+    CHECK(RtlTraceRing::format(&records[0], text, sizeof(text)) > 0 && strstr(text, "unknown") != NULL);
+}
+
+/*
+ * Every device is found by its VID/PID, and its chip carries the bring-up
+ * of a controller whose local version identifies nothing.
+ */
+static void
+testDeviceTable(const FwPatchIndex *entry)
+{
+    const FwChip *chip = NULL;
+
+    for (int i = 0; i < fwDeviceNumber; i++) {
+        CHECK(findFWDevice(fwDeviceList[i].vendor, fwDeviceList[i].product) == &fwDeviceList[i]);
+    }
+    CHECK(findFWDevice(0x0bda, 0x0000) == NULL);
+    CHECK(findFWDevice(0xffff, 0xffff) == NULL);
+
+    for (int i = 0; i < fwChipNumber; i++) {
+        if (fwChipList[i].firmware && strcmp(fwChipList[i].firmware, entry->patch.name) == 0) {
+            chip = &fwChipList[i];
+        }
+    }
+    CHECK(chip != NULL);
+    if (chip) {
+        RtlSimController sim(entry->lmp_subversion, 0, 0, entry->rom_version);
+        RtlCore core(&sim);
+
+        CHECK(entry->rom_version >= 32 || (chip->rom_versions & (1U << entry->rom_version)));
+        CHECK(!core.setupFirmware());
+        core.setChip(chip);
+        CHECK(core.setupFirmware());
+        CHECK(sim.isPatched());
+    }
+}
+
+/* The simulated bus time is reproducible and tracks the bus speed. */
+static uint64_t
+busTimeNs(const FwPatchIndex *entry, const RtlSimLatency *model, uint32_t seed)
+{
+    const RtlChipId *id = rtlFindChipId(entry->patch.name);
+    RtlSimController sim(id->lmpSubver, id->hciRev, id->hciVer, entry->rom_version);
+
+    sim.setLatencyModel(model, seed);
+    CHECK(rtlTestSetup(&sim));
+    return sim.elapsedNs();
+}
+
+static void
+testBusLatency(const FwPatchIndex *entry)
+{
+    uint64_t full = busTimeNs(entry, &rtlSimLatencyFullSpeed, 7);
+
+    CHECK(full > 0);
+    CHECK(busTimeNs(entry, &rtlSimLatencyFullSpeed, 7) == full);
+    CHECK(busTimeNs(entry, &rtlSimLatencyHighSpeed, 7) < full);
+}
+
+static bool
+isCompleteFor(const uint8_t *event, uint32_t size, uint16_t opcode)
+{
+    const HciResponse *resp = (const HciResponse *)event;
+    return size >= sizeof(HciResponse) && resp->evt.evt == HCI_EV_CMD_COMPLETE &&
+           OSSwapLittleToHostInt16(resp->opcode) == opcode;
+}
+
+/* Bulk commands, copied from the caller or built in a transport buffer. */
+static void
+testBulkCommands()
+{
+    RtlSimController sim(0x8723, 0xb, 0x6, 0);
+    RtlCore core(&sim);
+    uint8_t buf[CMD_BUF_MAX_SIZE];
+    uint8_t event[HCI_MAX_EVENT_SIZE];
+    HciCommandHdr *cmd = (HciCommandHdr *)buf;
+    uint32_t size = 0;
+
+    cmd->opcode = OSSwapHostToLittleInt16(HCI_OP_READ_LOCAL_VERSION);
+    cmd->len = 0;
+    CHECK(core.bulkHCISync(cmd, event, sizeof(event), &size, 100));
+    CHECK(isCompleteFor(event, size, HCI_OP_READ_LOCAL_VERSION));
+    CHECK(!sim.bulkReadBufferLent());
+
+    // No event buffer, as securedSend does, and one too small for the event
+    CHECK(core.bulkHCISync(cmd, NULL, 0, NULL, 100));
+    CHECK(!core.bulkHCISync(cmd, event, sizeof(HciResponse), &size, 100));
+    CHECK(size == 0);
+    CHECK(!sim.bulkReadBufferLent());
+
+    // Borrowed where it was read, until released
+    const void *borrowed = NULL;
+    CHECK(core.bulkHCIBorrow(cmd, &borrowed, &size, 100));
+    CHECK(borrowed && isCompleteFor((const uint8_t *)borrowed, size, HCI_OP_READ_LOCAL_VERSION));
+    CHECK(sim.bulkReadBufferLent());
+    core.releaseBulkEvent(borrowed);
+    CHECK(!sim.bulkReadBufferLent());
+
+    cmd = core.acquireBulkCommand(HCI_COMMAND_HDR_SIZE);
+    CHECK(cmd != NULL);
+    if (cmd) {
+        // The only buffer is lent out
+        CHECK(core.acquireBulkCommand(HCI_COMMAND_HDR_SIZE) == NULL);
+        cmd->opcode = OSSwapHostToLittleInt16(HCI_OP_RTL_READ_ROM_VERSION);
+        cmd->len = 0;
+        size = 0;
+        CHECK(core.submitBulkCommand(cmd, event, sizeof(event), &size, 100));
+        CHECK(isCompleteFor(event, size, HCI_OP_RTL_READ_ROM_VERSION));
+        CHECK(!sim.bulkBufferLent());
+    }
+
+    CHECK(core.acquireBulkCommand(RTL_SIM_BULK_BUFFER_SIZE + 1) == NULL);
+    CHECK(!sim.bulkBufferLent());
+    cmd = core.acquireBulkCommand(HCI_COMMAND_HDR_SIZE);
+    CHECK(cmd != NULL);
+    core.releaseBulkCommand(cmd);
+    CHECK(!sim.bulkBufferLent());
+}
+
+/* A transport that can only copy bulk responses out. */
+class RtlCopyingSimController : public RtlSimController {
+public:
+    RtlCopyingSimController() : RtlSimController(0x8723, 0xb, 0x6, 0) {}
+
+    virtual IOReturn bulkReadPooled(void **bytes, uint32_t *size, uint32_t timeout) override
+    {
+        (void)size;
+        (void)timeout;
+        *bytes = NULL;
+        return kIOReturnUnsupported;
+    }
+};
+
+static void
+testBulkBorrowCopying()
+{
+    RtlCopyingSimController sim;
+    RtlCore core(&sim);
+    uint8_t buf[CMD_BUF_MAX_SIZE];
+    uint8_t event[HCI_MAX_EVENT_SIZE];
+    HciCommandHdr *cmd = (HciCommandHdr *)buf;
+    const void *borrowed = NULL;
+    uint32_t size = 0;
+
+    cmd->opcode = OSSwapHostToLittleInt16(HCI_OP_READ_LOCAL_VERSION);
+    cmd->len = 0;
+    CHECK(core.bulkHCIBorrow(cmd, &borrowed, &size, 100));
+    CHECK(borrowed && isCompleteFor((const uint8_t *)borrowed, size, HCI_OP_READ_LOCAL_VERSION));
+    core.releaseBulkEvent(borrowed);
+    CHECK(core.bulkHCISync(cmd, event, sizeof(event), &size, 100));
+    CHECK(isCompleteFor(event, size, HCI_OP_READ_LOCAL_VERSION));
+    CHECK(!core.bulkHCISync(cmd, event, sizeof(HciResponse), &size, 100));
+    CHECK(size == 0);
+}
+
+/* A buffer shorter than the event is an overrun on both pipes. */
+static void
+testEventOverrun()
+{
+    RtlSimController sim(0x8723, 0xb, 0x6, 0);
+    uint8_t buf[CMD_BUF_MAX_SIZE];
+    uint8_t event[HCI_MAX_EVENT_SIZE];
+    HciCommandHdr *cmd = (HciCommandHdr *)buf;
+    uint32_t size = 0;
+
+    cmd->opcode = OSSwapHostToLittleInt16(HCI_OP_READ_LOCAL_VERSION);
+    cmd->len = 0;
+    CHECK(sim.sendHCIRequest(cmd, 100) == kIOReturnSuccess);
+    CHECK(sim.interruptPipeRead(event, sizeof(HciResponse), &size, 100) == kIOReturnOverrun);
+    CHECK(size == sizeof(HciResponse));
+
+    CHECK(sim.bulkWrite(cmd, HCI_COMMAND_HDR_SIZE, 100) == kIOReturnSuccess);
+    CHECK(sim.bulkPipeRead(event, sizeof(HciResponse), &size, 100) == kIOReturnOverrun);
+    CHECK(sim.bulkWrite(cmd, HCI_COMMAND_HDR_SIZE, 100) == kIOReturnSuccess);
+    CHECK(sim.interruptPipeRead(event, sizeof(event), &size, 100) == kIOReturnTimeout);
+    CHECK(sim.bulkPipeRead(event, sizeof(event), &size, 100) == kIOReturnSuccess);
+    CHECK(isCompleteFor(event, size, HCI_OP_READ_LOCAL_VERSION));
+}
+
+typedef struct {
+    uint32_t    chunks;
+    uint32_t    bytes;
+    uint8_t     first[16];
+} SnoopCapture;
+
+static void
+snoopSink(void *context, const uint8_t *data, uint32_t len)
+{
+    SnoopCapture *capture = (SnoopCapture *)context;
+
+    if (!capture->bytes && len >= sizeof(capture->first)) {
+        memcpy(capture->first, data, sizeof(capture->first));
+    }
+    capture->chunks++;
+    capture->bytes += len;
+}
+
+/* A small capture buffer is reused once drained, across a whole bring-up. */
+static void
+testSnoop(const FwPatchIndex *entry)
+{
+    const RtlChipId *id = rtlFindChipId(entry->patch.name);
+    RtlSimController sim(id->lmpSubver, id->hciRev, id->hciVer, entry->rom_version);
+    RtlCore core(&sim);
+    RtlSnoop *snoop = core.snoop();
+    SnoopCapture capture = {};
+    uint8_t packet[8] = {};
+
+    CHECK(snoop->start(1024, NULL, NULL, 0));
+    for (int i = 0; i < 200; i++) {
+        snoop->record(RTL_SNOOP_H4_COMMAND, false, packet, sizeof(packet));
+        snoop->drain(snoopSink, &capture);
+    }
+    CHECK(snoop->drops() == 0);
+    CHECK(capture.chunks == 200);
+    CHECK(capture.bytes == 16 + 200 * (24 + 1 + sizeof(packet)));
+    CHECK(memcmp(capture.first, "btsnoop", 8) == 0);
+
+    // Without draining, a full buffer drops instead of overwriting
+    for (int i = 0; i < 200; i++) {
+        snoop->record(RTL_SNOOP_H4_COMMAND, false, packet, sizeof(packet));
+    }
+    CHECK(snoop->drops() > 0);
+    snoop->drain(snoopSink, &capture);
+    CHECK(core.setupFirmware());
+    snoop->stop();
+}
+
+static void
+countEvent(void *context, const uint8_t *event, uint32_t len)
+{
+    (void)event;
+    (void)len;
+    (*(uint32_t *)context)++;
+}
+
+/*
+ * Events nobody asked for, arriving ahead of a Command Complete, must not
+ * break the bring-up: handled ones reach their handler, the rest stay
+ * queued for waitForEvent.
+ */
+static void
+testUnsolicitedEvents(const FwPatchIndex *entry)
+{
+    const RtlChipId *id = rtlFindChipId(entry->patch.name);
+    RtlSimController sim(id->lmpSubver, id->hciRev, id->hciVer, entry->rom_version);
+    RtlCore core(&sim);
+    const uint8_t hardwareError[] = { 0x10, 1, 0 };
+    const uint8_t vendor[] = { 0xff, 1, 0x05 };
+    uint8_t event[HCI_MAX_EVENT_SIZE];
+    uint32_t errors = 0, size = 0;
+
+    CHECK(core.registerEventHandler(0x10, countEvent, &errors));
+    CHECK(sim.injectEvent(hardwareError, sizeof(hardwareError)));
+    CHECK(sim.injectEvent(vendor, sizeof(vendor)));
+    CHECK(core.setupFirmware());
+    CHECK(sim.isPatched());
+    CHECK(errors == 1);
+    CHECK(core.waitForEvent(0xff, event, sizeof(event), &size, 10));
+    CHECK(size == sizeof(vendor) && memcmp(event, vendor, size) == 0);
+    core.unregisterEventHandler(0x10);
+}
+
+/* A wait that sees nothing says so, rtlBoot only resets on that. */
+static void
+testEventTimeout()
+{
+    RtlSimController sim(0x8723, 0xb, 0x6, 0);
+    RtlCore core(&sim);
+    uint8_t event[HCI_MAX_EVENT_SIZE];
+    uint32_t size = 0;
+
+    CHECK(!core.waitForEvent(0xff, event, sizeof(event), &size, 10));
+    CHECK(core.lastReadError() == kIOReturnTimeout);
+}
+
+int main()
+{
+    uint32_t v1 = 0, v2 = 0, raw = 0, configs = 0, variants = 0, codecs = 0;
+
+    for (uint32_t i = 0; i <= fwPatchIndexMask; i++) {
+        const FwPatchIndex *entry = &fwPatchIndex[i];
+        if (!entry->patch.var) {
+            continue;
+        }
+        const RtlChipId *id = rtlFindChipId(entry->patch.name);
+        bool isRaw = id && (id->quirks & FW_CHIP_RAW_PATCH);
+        printf("== %s ROM 0x%02x, %s, codec %d\n", entry->patch.name, entry->rom_version,
+               isRaw ? "raw" : entry->fw_version ? "epatch v1" : "epatch v2", entry->patch.codec);
+        CHECK(findFWPatch(entry->patch.name, entry->rom_version) == entry);
+        testColdBringUp(entry);
+        testResidentDownload(entry);
+        testPipelinedDownload(entry, 4);
+        // v2 and raw patches carry no fw_version to recognize them by
+        if (isRaw) {
+            CHECK(entry->fw_version == 0 && entry->rom_version == 0 && entry->config_size == 0);
+            raw++;
+        } else if (entry->fw_version) {
+            CHECK(findFWPatchByVersion(entry->fw_version, entry->rom_version) == entry);
+            testWarmStart(entry);
+            v1++;
+        } else {
+            v2++;
+        }
+        // The config goes out at the end of the patch record
+        if (entry->config_size) {
+            CHECK(entry->config_size < (uint32_t)entry->patch.uncompressed_size);
+            configs++;
+        }
+        testCorruptPatch(entry);
+        codecs |= 1 << entry->patch.codec;
+    }
+    CHECK(v1 > 0);
+    CHECK(v2 > 0);
+    CHECK(raw > 0);
+    CHECK(configs > 0);
+    CHECK(findFWPatchByVersion(0, 0) == NULL);
+    testBulkCommands();
+    testBulkBorrowCopying();
+    testEventOverrun();
+    testEventTimeout();
+    testTraceRing();
+    for (uint32_t i = 0; i <= fwPatchIndexMask; i++) {
+        if (fwPatchIndex[i].patch.var) {
+            testUnsolicitedEvents(&fwPatchIndex[i]);
+            testBusLatency(&fwPatchIndex[i]);
+            testHciStats(&fwPatchIndex[i]);
+            testSnoop(&fwPatchIndex[i]);
+            testDeviceTable(&fwPatchIndex[i]);
+            break;
+        }
+    }
+    for (int i = 0; i < fwNumber; i++) {
+        if (fwList[i].dict) {
+            testDictionaryVariant(&fwList[i]);
+            variants++;
+        }
+    }
+    CHECK(variants > 0);
+
+    // What the last driver instance does before the kext unloads
+    RtlPatchCacheStats stats;
+    RtlPatchCache::shared()->teardown();
+    RtlPatchCache::shared()->getStats(&stats);
+    CHECK(stats.entries == 0 && stats.bytes == 0);
+    RtlPatchCache::shared()->teardown();
+
+    printf("%d checks, %d failed (%u v1, %u v2 and %u raw patches, codec mask 0x%x)\n", gChecks, gFailures, v1, v2, raw, codecs);
+    return gFailures ? 1 : 0;
+}
@@ -1,7 +1,15 @@
+import argparse
 import os
+import re
+import struct
 import textwrap
 import zlib
 
+try:
+    import lz4.block as lz4_block
+except ImportError:
+    lz4_block = None
+
 # --- Cấu hình ---
 # Thư mục chứa các file firmware .bin gốc
 FIRMWARE_SOURCE_DIR = os.path.join("..", "RealtekBluetoothFirmware", "fw")
@@ -11,25 +19,540 @@ FIRMWARE_DEST_DIR = os.path.join("..", "RealtekBluetoothFirmware")
 
 # Tên file .cpp sẽ được tạo ra
 OUTPUT_CPP_FILE = "FwData.cpp"
+
+# Info.plist của kext; IOKitPersonalities được sinh lại từ DEVICES
+INFO_PLIST_FILE = "Info.plist"
+
+# Điểm probe chung của các personality
+PROBE_SCORE = 4000
+
+# Bảng nhận dạng chip (RTL_CHIP_ID trong RtlChipId.h): chip nào dùng firmware,
+# config nào; script đọc lại bảng này thay vì giữ một bản sao riêng
+CHIP_ID_HEADER = os.path.join(FIRMWARE_DEST_DIR, "RtlChipId.h")
+
+# Tên file trong linux-firmware/rtl_bt; RtlChipId.h có static_assert tương ứng
+CHIP_FIRMWARE_NAME = re.compile(r"^rtl\w+_fw\.bin$")
+CHIP_CONFIG_NAME = re.compile(r"^rtl\w+_config\.bin$")
+
+# VID/PID -> chip (trước đây là supportedDevices[] trong RealtekBluetoothFirmware.cpp)
+DEVICES = [
+    (0x0BDA, 0x8761, "RTL8761B"),
+    (0x0BDA, 0x8821, "RTL8821A"),
+    (0x0BDA, 0xB720, "RTL8723B"),
+    (0x0BDA, 0xB723, "RTL8723B"),
+    (0x0BDA, 0xB728, "RTL8723B"),
+    (0x0BDA, 0xB822, "RTL8822B"),
+    (0x0BDA, 0xC821, "RTL8821C"),
+    (0x0BDA, 0xC82C, "RTL8822C"),
+    (0x0BDA, 0xD723, "RTL8723D"),
+    (0x0BDA, 0x1724, "RTL8723A"),
+]
+
+# project_id trong phần mở rộng epatch v1 -> lmp_subversion, theo btrtl.c
+PROJECT_ID_TO_LMP_SUBVER = {
+    0: 0x1200, 1: 0x8723, 2: 0x8821, 3: 0x8761, 7: 0x8703, 8: 0x8822,
+    9: 0x8723, 10: 0x8821, 13: 0x8822, 14: 0x8761, 18: 0x8852, 20: 0x8852,
+    25: 0x8852, 36: 0x8851, 47: 0x8852,
+}
 # -----------------
 
+EPATCH_SIGNATURE = b"Realtech"
+EPATCH_SIGNATURE_V2 = b"RTBTCore"
+EXTENSION_SIG = bytes([0x51, 0x04, 0xfd, 0x77])
+RTL_PATCH_SNIPPETS = 0x01
+RTL_PATCH_DUMMY_HEADER = 0x02
+RTL_PATCH_SECURITY_HEADER = 0x03
+
+# Chữ ký đầu file rtl*_config.bin (struct rtl_vendor_config trong btrtl.h)
+RTL_CONFIG_MAGIC = 0x8723ab55
+RTL_CONFIG_HEADER_LEN = 6
+
+# Giá trị rỗng của project_id trong FwPatchIndex
+NO_PROJECT_ID = 0xff
+
+# FwCodec trong FwData.h
+FW_CODEC_NONE = "FW_CODEC_NONE"
+FW_CODEC_ZLIB = "FW_CODEC_ZLIB"
+FW_CODEC_LZ4 = "FW_CODEC_LZ4"
+
+# Chính sách chọn codec: LZ4 giải nén nhanh hơn zlib nhiều lần, nên được
+# chọn khi bản LZ4 không lớn hơn bản zlib quá tỉ lệ này
+LZ4_MAX_SIZE_RATIO = 1.5
+
+# Mô hình chi phí giải nén (MB/s dữ liệu ra) của chính driver, tức là
+# RtlFwStream::decode kể cả hai lần kiểm tra CRC32C, đo trên bản build host
+# (x86_64, -O2) với các fixture của host/make_fixtures.py. Không đo bằng
+# module Python trên máy build vì tốc độ đó không phải của kext. Đo lại
+# khi đổi bộ giải nén và cập nhật các số này.
+DECODE_MBPS = {
+    FW_CODEC_NONE: 4000,
+    FW_CODEC_LZ4: 380,
+    FW_CODEC_ZLIB: 170,
+}
+
+# Các biến thể gần giống nhau (rtl8192cufw*, rtl8710bufw_*...) được nén với
+# một blob gốc làm từ điển khi tiết kiệm được ít nhất tỉ lệ này
+DEDUP_MIN_SAVING = 0.15
+
+# Cửa sổ tối đa của offset trong LZ4
+LZ4_WINDOW = 0xffff
+
 def format_to_c_array(data):
     """Chuyển đổi dữ liệu byte thành một chuỗi mảng C được định dạng."""
     hex_values = [f"0x{byte:02x}" for byte in data]
     wrapped_lines = textwrap.wrap(", ".join(hex_values), width=70)
-    return ",\n  ".join(wrapped_lines)
+    return "\n  ".join(wrapped_lines)
+
+def find_project_id(data):
+    """Đọc ngược phần mở rộng ở cuối file epatch v1 để tìm project_id."""
+    if data[-4:] != EXTENSION_SIG:
+        return None
+    pos = len(data) - 4
+    while pos >= 14 + 3:
+        opcode, length, value = data[pos - 1], data[pos - 2], data[pos - 3]
+        pos -= 3
+        if opcode == 0xff or length == 0:
+            return None
+        if opcode == 0 and length == 1:
+            return value
+        pos -= length
+    return None
+
+def extract_patches(data):
+    """Trả về (fw_version, project_id, {rom_version: patch}) hoặc None.
+
+    Mỗi patch là đúng các byte sẽ được tải xuống chip: với v1 là đoạn của
+    chip_id với fw_version ghi đè 4 byte cuối, với v2 là các subsection
+    của eco đó nối lại theo thứ tự prio như btrtl_insert_ordered_subsec.
+    """
+    if data[:8] == EPATCH_SIGNATURE and len(data) >= 14:
+        fw_version, num_patches = struct.unpack_from("<IH", data, 8)
+        if len(data) < 14 + 8 * num_patches:
+            return None
+        project_id = find_project_id(data)
+        patches = {}
+        for i in range(num_patches):
+            chip_id = struct.unpack_from("<H", data, 14 + 2 * i)[0]
+            length = struct.unpack_from("<H", data, 14 + 2 * num_patches + 2 * i)[0]
+            offset = struct.unpack_from("<I", data, 14 + 4 * num_patches + 4 * i)[0]
+            if chip_id == 0 or offset == 0 or length < 4 or offset + length > len(data):
+                continue
+            patches[chip_id - 1] = data[offset:offset + length - 4] + struct.pack("<I", fw_version)
+        return fw_version, project_id, patches
+    if data[:8] == EPATCH_SIGNATURE_V2 and len(data) >= 20:
+        num_sections = struct.unpack_from("<I", data, 16)[0]
+        pos = 20
+        subsecs = {}
+        for _ in range(num_sections):
+            if pos + 8 > len(data):
+                return None
+            opcode, section_len = struct.unpack_from("<II", data, pos)
+            body, pos = pos + 8, pos + 8 + section_len
+            if pos > len(data):
+                return None
+            # Chưa đọc key_id từ chip nên bỏ qua security header như driver
+            if opcode not in (RTL_PATCH_SNIPPETS, RTL_PATCH_DUMMY_HEADER):
+                continue
+            if section_len < 4:
+                return None
+            sub_pos = body + 4
+            for _ in range(struct.unpack_from("<H", data, body)[0]):
+                if sub_pos + 8 > pos:
+                    return None
+                eco, prio = data[sub_pos], data[sub_pos + 1]
+                sub_len = struct.unpack_from("<I", data, sub_pos + 4)[0]
+                if sub_pos + 8 + sub_len > pos:
+                    return None
+                if eco > 0:
+                    subsecs.setdefault(eco - 1, []).append((prio, data[sub_pos + 8:sub_pos + 8 + sub_len]))
+                sub_pos += 8 + sub_len
+        patches = {}
+        for rom_version, items in subsecs.items():
+            # Subsection mới được chèn trước các subsection cùng prio
+            order = sorted(range(len(items)), key=lambda i: (items[i][0], -i))
+            patches[rom_version] = b"".join(items[i][1] for i in order)
+        return 0, None, patches
+    return None
+
+def read_config(name, data):
+    """Kiểm tra một file config và trả về đúng các byte sẽ được tải xuống chip.
+
+    Config chỉ được nối vào sau patch, nên độ dài thật phải lấy từ total_len
+    trong header: phần thừa phía sau bị cắt bỏ, file thiếu hoặc entry vượt
+    quá total_len thì bị loại.
+    """
+    if len(data) < RTL_CONFIG_HEADER_LEN or struct.unpack_from("<I", data)[0] != RTL_CONFIG_MAGIC:
+        print(f"  ! {name} không phải file config, bỏ qua")
+        return None
+    end = RTL_CONFIG_HEADER_LEN + struct.unpack_from("<H", data, 4)[0]
+    if end > len(data):
+        print(f"  ! {name}: total_len {end - RTL_CONFIG_HEADER_LEN} vượt quá file, bỏ qua")
+        return None
+    pos = RTL_CONFIG_HEADER_LEN
+    while pos + 3 <= end:
+        pos += 3 + data[pos + 2]
+    if pos != end:
+        print(f"  ! {name}: entry không khớp total_len, bỏ qua")
+        return None
+    if len(data) > end:
+        print(f"  - {name}: cắt {len(data) - end} byte thừa sau total_len")
+    return data[:end]
+
+# CRC32C (Castagnoli), cùng kết quả với rtlCrc32c trong RtlCrc32c.cpp
+CRC32C_TABLE = []
+for _i in range(256):
+    _crc = _i
+    for _ in range(8):
+        _crc = (_crc >> 1) ^ (0x82f63b78 if _crc & 1 else 0)
+    CRC32C_TABLE.append(_crc)
+
+def crc32c(data):
+    crc = 0xffffffff
+    for byte in data:
+        crc = CRC32C_TABLE[(crc ^ byte) & 0xff] ^ (crc >> 8)
+    return crc ^ 0xffffffff
+
+# Cùng công thức với fwNameHash/fwKeyHash trong FwData.h
+def fw_key_hash(key, seed):
+    h = (key ^ seed) & 0xffffffff
+    h = ((h ^ (h >> 16)) * 0x85ebca6b) & 0xffffffff
+    h = ((h ^ (h >> 13)) * 0xc2b2ae35) & 0xffffffff
+    return h ^ (h >> 16)
+
+def fnv1a(name):
+    h = 2166136261
+    for c in name.encode():
+        h = ((h ^ c) * 16777619) & 0xffffffff
+    return h
+
+def fw_name_hash(name, seed):
+    # Các bit thấp của FNV-1a không phụ thuộc vào bit cao của seed,
+    # nên seed được trộn vào qua fw_key_hash
+    return fw_key_hash(fnv1a(name), seed)
+
+# Cùng công thức với fwPatchKey trong FwData.h
+def fw_patch_key(name, rom_version):
+    return fnv1a(name) ^ rom_version
+
+# Cùng công thức với fwPatchVersionKey trong FwData.h
+def fw_patch_version_key(fw_version, rom_version):
+    return ((fw_version * 16777619) & 0xffffffff) ^ rom_version
+
+def build_perfect_hash(keys, hash_fn):
+    """Tìm seed sao cho mọi khóa rơi vào một ô riêng của bảng 2^n ô."""
+    size = 1
+    while size < 2 * len(keys):
+        size *= 2
+    for seed in range(1 << 24):
+        slots = {}
+        for key in keys:
+            slot = hash_fn(key, seed) & (size - 1)
+            if slot in slots:
+                break
+            slots[slot] = key
+        else:
+            return seed, size, slots
+    raise RuntimeError("Không tìm được perfect hash")
+
+def lz4_write_length(out, value):
+    while value >= 255:
+        out.append(255)
+        value -= 255
+    out.append(value)
+
+def lz4_sequence(out, literals, offset=0, match_len=0):
+    """Viết một sequence LZ4: token, literal, rồi offset và độ dài match."""
+    match_len = match_len - 4 if offset else 0
+    out.append((min(len(literals), 15) << 4) | min(match_len, 15))
+    if len(literals) >= 15:
+        lz4_write_length(out, len(literals) - 15)
+    out += literals
+    if offset:
+        out += struct.pack("<H", offset)
+        if match_len >= 15:
+            lz4_write_length(out, match_len - 15)
+
+def lz4_compress(data, dictionary=b""):
+    """Nén theo định dạng LZ4 block (greedy, bảng băm 4 byte).
+
+    Match có thể trỏ ngược vào dictionary, coi như nằm ngay trước data.
+    """
+    dictionary = dictionary[-LZ4_WINDOW:]
+    if lz4_block is not None:
+        return lz4_block.compress(data, mode="high_compression", store_size=False, dict=dictionary)
+    out = bytearray()
+    data = dictionary + data
+    table = {data[i:i + 4]: i for i in range(len(dictionary) - 3)}
+    anchor = pos = len(dictionary)
+    # Match phải bắt đầu trước 12 byte cuối và 5 byte cuối luôn là literal
+    limit = len(data) - 12
+    while pos < limit:
+        key = data[pos:pos + 4]
+        candidate = table.get(key)
+        table[key] = pos
+        if candidate is None or pos - candidate > LZ4_WINDOW:
+            pos += 1
+            continue
+        length = 4
+        while pos + length < len(data) - 5 and data[candidate + length] == data[pos + length]:
+            length += 1
+        lz4_sequence(out, data[anchor:pos], pos - candidate, length)
+        pos += length
+        anchor = pos
+    lz4_sequence(out, data[anchor:])
+    return bytes(out)
+
+def lz4_decompress(data, size, dictionary=b""):
+    """Giải nén tham chiếu, chỉ để kiểm tra lại bộ nén."""
+    dictionary = dictionary[-LZ4_WINDOW:]
+    if lz4_block is not None:
+        return lz4_block.decompress(data, uncompressed_size=size, dict=dictionary)
+    out = bytearray(dictionary)
+    pos = 0
+
+    def read_length(length):
+        nonlocal pos
+        if length == 15:
+            while True:
+                length += data[pos]
+                pos += 1
+                if data[pos - 1] != 255:
+                    break
+        return length
+
+    while pos < len(data):
+        token = data[pos]
+        pos += 1
+        literals = read_length(token >> 4)
+        out += data[pos:pos + literals]
+        pos += literals
+        if pos == len(data):
+            break
+        offset = struct.unpack_from("<H", data, pos)[0]
+        pos += 2
+        for _ in range(read_length(token & 0xf) + 4):
+            out.append(out[-offset])
+    return bytes(out[len(dictionary):len(dictionary) + size])
+
+def zlib_compress(data, dictionary=b""):
+    if not dictionary:
+        return zlib.compress(data, 9)
+    z = zlib.compressobj(9, zdict=dictionary)
+    return z.compress(data) + z.flush()
+
+def compress_blob(content, dictionary=b""):
+    """Chọn codec cho một blob, trả về (dữ liệu, codec)."""
+    zlib_data = zlib_compress(content, dictionary)
+    lz4_data = lz4_compress(content, dictionary)
+    if lz4_decompress(lz4_data, len(content), dictionary) != content:
+        raise RuntimeError("Bộ nén LZ4 tạo dữ liệu sai")
+    if len(lz4_data) < len(content) and len(lz4_data) <= len(zlib_data) * LZ4_MAX_SIZE_RATIO:
+        return lz4_data, FW_CODEC_LZ4
+    if len(zlib_data) < len(content):
+        return zlib_data, FW_CODEC_ZLIB
+    return content, FW_CODEC_NONE
+
+def choose_dictionaries(contents):
+    """Ghép mỗi biến thể với blob gốc giống nó nhất, trả về {tên: tên gốc}.
+
+    Blob gốc luôn được nén độc lập nên không có chuỗi từ điển lồng nhau.
+    """
+    standalone = {name: len(zlib_compress(data)) for name, data in contents.items()}
+    candidates = []
+    for name, data in contents.items():
+        for base, base_data in contents.items():
+            size = len(zlib_compress(data, base_data)) if base != name else standalone[name]
+            if size <= standalone[name] * (1 - DEDUP_MIN_SAVING):
+                candidates.append((standalone[name] - size, name, base))
+    bases, dicts = set(), {}
+    for _, name, base in sorted(candidates, reverse=True):
+        if name in bases or name in dicts or base in dicts:
+            continue
+        dicts[name] = base
+        bases.add(base)
+    return dicts
+
+def write_blob(f, var_name, comment, content, stats, dictionary=b""):
+    """Viết một mảng C++ và trả về phần khởi tạo FwDesc tương ứng (trừ .name và .dict)."""
+    data, codec = compress_blob(content, dictionary)
+    decode_us = len(content) / DECODE_MBPS[codec]
+    total = stats.setdefault(codec, [0, 0, 0.0])
+    total[0] += len(content)
+    total[1] += len(data)
+    total[2] += decode_us
+    f.write(f"// {comment}\n")
+    f.write(f"const unsigned char {var_name}[] = {{\n  ")
+    f.write(format_to_c_array(data))
+    f.write("\n};\n")
+    f.write(f"const unsigned int {var_name}_len = {len(data)};\n\n")
+    print(f"  - {comment}: {len(content)} bytes -> {len(data)} bytes ({codec}, giải nén ~{decode_us:.0f} us)")
+    return (f".var = {var_name}, .size = {var_name}_len, .codec = {codec}, .uncompressed_size = {len(content)}, "
+            f".crc32c = 0x{crc32c(content):08x}, .stored_crc32c = 0x{crc32c(data):08x}")
+
+def read_chip_ids(path):
+    """Đọc các dòng RTL_CHIP_ID, trả về {tên: (lmp_subversion, firmware, config, quirk)}."""
+    pattern = re.compile(r'RTL_CHIP_ID\("(\w+)",\s*(0x[0-9a-fA-F]+),\s*(0x[0-9a-fA-F]+),\s*(0x[0-9a-fA-F]+),'
+                         r'\s*\w+,\s*("[^"]*"|NULL),\s*("[^"]*"|NULL),\s*([\w |]+)\)')
+    chips = {}
+    with open(path) as header:
+        for match in pattern.finditer(header.read()):
+            name, lmp_subversion, _, _, firmware, config, quirks = match.groups()
+            if name in chips:
+                raise RuntimeError(f"Chip {name} bị khai báo hai lần trong {path}")
+            chips[name] = (int(lmp_subversion, 16), firmware.strip('"') if firmware != "NULL" else None,
+                           config.strip('"') if config != "NULL" else None,
+                           [q.strip() for q in quirks.split("|") if q.strip() != "0"])
+    if not chips:
+        raise RuntimeError(f"Không đọc được bảng chip trong {path}")
+    return chips
+
+def check_chips(chips, firmware_files):
+    """Mỗi chip phải có tên firmware hợp lệ; chip không có file firmware trong
+    thư mục nguồn, hoặc không có VID/PID nào trong DEVICES, thì cảnh báo."""
+    used = {chip for _, _, chip in DEVICES}
+    for name, (lmp_subversion, firmware, config, _) in sorted(chips.items()):
+        if not firmware or not CHIP_FIRMWARE_NAME.match(firmware):
+            raise RuntimeError(f"Chip {name}: tên firmware {firmware} không phải file rtl_bt")
+        if config and not CHIP_CONFIG_NAME.match(config):
+            raise RuntimeError(f"Chip {name}: tên config {config} không phải file rtl_bt")
+        if name not in used:
+            print(f"  ! {name}: không có VID/PID nào trong DEVICES, chỉ nhận diện được qua HCI")
+        if firmware not in firmware_files:
+            print(f"  ! {name}: không tìm thấy {firmware}, chip 0x{lmp_subversion:04x} sẽ không có firmware")
+
+def c_string(value):
+    return f'"{value}"' if value else "NULL"
+
+def write_device_db(f, chips, patch_entries):
+    """Viết fwChipList và fwDeviceList đã sắp xếp theo (VID, PID) cho findFWDevice."""
+    chip_position = {name: i for i, name in enumerate(sorted(chips))}
+    f.write("// Mô tả chip; rom_versions là các ROM version có patch được nhúng\n")
+    f.write("const struct FwChip fwChipList[] = {\n")
+    for name in sorted(chips):
+        lmp_subversion, firmware, config, quirks = chips[name]
+        rom_versions = 0
+        for patch_name, _, rom_version, _, _, _, _ in patch_entries.values():
+            if patch_name == firmware and rom_version < 32:
+                rom_versions |= 1 << rom_version
+        f.write(f'    {{ .name = "{name}", .lmp_subversion = 0x{lmp_subversion:04x}, '
+                f".firmware = {c_string(firmware)}, .config = {c_string(config)},\n"
+                f"      .quirks = {' | '.join(quirks) or 0}, .rom_versions = 0x{rom_versions:08x} }},\n")
+    f.write("};\n")
+    f.write(f"const int fwChipNumber = {len(chips)};\n\n")
+
+    devices = sorted(DEVICES)
+    for previous, device in zip(devices, devices[1:]):
+        if previous[:2] == device[:2]:
+            raise RuntimeError(f"Thiết bị {device[0]:04x}:{device[1]:04x} bị khai báo hai lần")
+    f.write("// Thiết bị được hỗ trợ, sắp xếp theo (VID, PID) để tìm kiếm nhị phân\n")
+    f.write("const struct FwDevice fwDeviceList[] = {\n")
+    for vendor, product, chip in devices:
+        if chip not in chip_position:
+            raise RuntimeError(f"Thiết bị {vendor:04x}:{product:04x} trỏ tới chip {chip} không có trong bảng")
+        f.write(f"    {{ .vendor = 0x{vendor:04x}, .product = 0x{product:04x}, .chip = &fwChipList[{chip_position[chip]}] }},"
+                f" // {chip}\n")
+    f.write("};\n")
+    f.write(f"const int fwDeviceNumber = {len(devices)};\n")
+    print(f"  - Thiết bị: {len(devices)} VID/PID, {len(chips)} chip")
+
+def write_personalities(plist_path):
+    """Sinh lại IOKitPersonalities trong Info.plist: mỗi VID/PID một personality.
+
+    IOKit lọc theo idVendor/idProduct trước khi tạo đối tượng, nên probe()
+    chỉ chạy cho thiết bị có trong bảng. Phần còn lại của file giữ nguyên.
+    """
+    with open(plist_path) as plist_file:
+        plist = plist_file.read()
+    key = "    <key>IOKitPersonalities</key>\n"
+    start = plist.index(key) + len(key)
+    end = plist.index("\n    </dict>\n", start) + len("\n    </dict>\n")
+    lines = ["    <dict>"]
+    for vendor, product, chip in sorted(DEVICES):
+        lines += [
+            f"        <key>{chip} {vendor:04x}:{product:04x}</key>",
+            "        <dict>",
+            "            <key>CFBundleIdentifier</key>",
+            "            <string>$(PRODUCT_BUNDLE_IDENTIFIER)</string>",
+            "            <key>IOClass</key>",
+            "            <string>RealtekBluetoothFirmware</string>",
+            "            <key>IOMatchCategory</key>",
+            "            <string>RtlBluetoothFirmware</string>",
+            "            <key>IOProviderClass</key>",
+            "            <string>IOUSBHostDevice</string>",
+            "            <key>IOProbeScore</key>",
+            f"            <integer>{PROBE_SCORE}</integer>",
+            "            <key>idVendor</key>",
+            f"            <integer>{vendor}</integer>",
+            "            <key>idProduct</key>",
+            f"            <integer>{product}</integer>",
+            "        </dict>",
+        ]
+    lines.append("    </dict>")
+    with open(plist_path, "w") as plist_file:
+        plist_file.write(plist[:start] + "\n".join(lines) + "\n" + plist[end:])
+    print(f"  - {plist_path}: {len(DEVICES)} personality")
 
 def main():
     """Hàm chính để tạo file FwData.cpp."""
-    output_path = os.path.join(FIRMWARE_DEST_DIR, OUTPUT_CPP_FILE)
+    parser = argparse.ArgumentParser(description="Sinh FwData.cpp từ các file firmware .bin")
+    parser.add_argument("--fw-dir", default=FIRMWARE_SOURCE_DIR, help="thư mục chứa các file .bin")
+    parser.add_argument("--out-dir", help="ghi FwData.cpp vào thư mục này (bản build trên máy host), "
+                                          "Info.plist của kext giữ nguyên")
+    args = parser.parse_args()
+    source_dir = args.fw_dir
+    output_path = os.path.join(args.out_dir or FIRMWARE_DEST_DIR, OUTPUT_CPP_FILE)
     
     # Tìm tất cả các file .bin trong thư mục nguồn
-    firmware_files = [f for f in os.listdir(FIRMWARE_SOURCE_DIR) if f.endswith(".bin")]
+    firmware_files = sorted(f for f in os.listdir(source_dir) if f.endswith(".bin"))
     
     if not firmware_files:
-        print(f"Không tìm thấy file .bin nào trong thư mục '{FIRMWARE_SOURCE_DIR}'.")
+        print(f"Không tìm thấy file .bin nào trong thư mục '{source_dir}'.")
         return
 
+    chips = read_chip_ids(CHIP_ID_HEADER)
+    check_chips(chips, firmware_files)
+
+    # --- Tách sẵn patch của từng (firmware, rom_version), nối sẵn config ---
+    patch_entries = {}
+    extracted_files = set()
+    for lmp_subversion, name, config_name, quirks in sorted(chips.values()):
+        if name not in firmware_files:
+            continue
+        config = b""
+        if config_name in firmware_files:
+            with open(os.path.join(source_dir, config_name), "rb") as bin_file:
+                config = read_config(config_name, bin_file.read()) or b""
+        elif "FW_CHIP_CONFIG_NEEDED" in quirks:
+            print(f"  ! {name}: chip cần {config_name} nhưng không tìm thấy file")
+        with open(os.path.join(source_dir, name), "rb") as bin_file:
+            data = bin_file.read()
+        if "FW_CHIP_RAW_PATCH" in quirks:
+            # Như btrtl_setup_rtl8723a: cả file là patch, không được là epatch
+            if data[:8] in (EPATCH_SIGNATURE, EPATCH_SIGNATURE_V2):
+                print(f"  ! {name}: chip 0x{lmp_subversion:04x} cần ảnh thô nhưng file là epatch, bỏ qua")
+                continue
+            epatch = (0, None, {0: data})
+        else:
+            epatch = extract_patches(data)
+        if epatch is None:
+            print(f"  ! {name} không phải file epatch, bỏ qua chip 0x{lmp_subversion:04x}")
+            continue
+        fw_version, project_id, patches = epatch
+        if project_id is not None and PROJECT_ID_TO_LMP_SUBVER.get(project_id) != lmp_subversion:
+            print(f"  ! {name}: project_id {project_id} không khớp chip 0x{lmp_subversion:04x}, bỏ qua")
+            continue
+        for rom_version, patch in sorted(patches.items()):
+            key = fw_patch_key(name, rom_version)
+            if key in patch_entries:
+                raise RuntimeError(f"Khóa patch của {name} ROM {rom_version} bị trùng")
+            # Chip nhận patch và config trong cùng một lần tải, như btrtl
+            patch_entries[key] = (name, lmp_subversion, rom_version,
+                                  NO_PROJECT_ID if project_id is None else project_id,
+                                  fw_version, patch + config, len(config))
+        extracted_files.add(name)
+        if config:
+            extracted_files.add(config_name)
+
     print(f"Đang tạo file '{output_path}'...")
 
     with open(output_path, "w") as f:
@@ -41,47 +564,113 @@ def main():
         f.write('#include "FwData.h"\n\n')
 
         # --- Xử lý và viết từng firmware ---
-        fw_definitions = []
+        # File epatch đã tách hết thành patch thì không cần nhúng nguyên file
+        contents = {}
         for filename in firmware_files:
-            var_name = filename.replace(".", "_")
-            
+            if filename in extracted_files:
+                continue
             # Đọc nội dung file firmware gốc
-            with open(os.path.join(FIRMWARE_SOURCE_DIR, filename), "rb") as bin_file:
-                original_content = bin_file.read()
-            
-            uncompressed_size = len(original_content)
-            
-            # Nén dữ liệu firmware
-            compressed_content = zlib.compress(original_content)
-            compressed_size = len(compressed_content)
-            
-            print(f"  - Đang xử lý {filename}: {uncompressed_size} bytes -> {compressed_size} bytes (nén)")
-
-            # Viết mảng C++ chứa dữ liệu ĐÃ NÉN
-            f.write(f"// Firmware: {filename} (đã nén)\n")
-            f.write(f"const unsigned char {var_name}[] = {{\n  ")
-            f.write(format_to_c_array(compressed_content))
-            f.write("\n};\n")
-            f.write(f"const unsigned int {var_name}_len = {compressed_size};\n\n")
-            
-            # Thêm vào danh sách để tạo fwList sau
+            with open(os.path.join(source_dir, filename), "rb") as bin_file:
+                contents[filename] = bin_file.read()
+        dictionaries = choose_dictionaries(contents) if len(contents) > 1 else {}
+        fw_position = {name: i for i, name in enumerate(contents)}
+
+        fw_definitions = []
+        stats = {}
+        for filename, original_content in contents.items():
+            var_name = filename.replace(".", "_")
+            base = dictionaries.get(filename)
+            comment = f"Firmware: {filename}" + (f", từ điển {base}" if base else "")
+            desc = write_blob(f, var_name, comment, original_content, stats, contents[base] if base else b"")
+            desc += f", .dict = &fwList[{fw_position[base]}]" if base else ", .dict = NULL"
             fw_definitions.append({
                 "name": filename,
-                "var": var_name,
-                "len_var": f"{var_name}_len",
-                "uncompressed_size": uncompressed_size
+                "desc": desc
             })
 
         # --- Viết mảng fwList ---
         f.write("// Danh sách tất cả các firmware được nhúng\n")
         f.write("const struct FwDesc fwList[] = {\n")
         for fw in fw_definitions:
-            f.write(f'    {{ .name = "{fw["name"]}", .var = {fw["var"]}, .size = {fw["len_var"]}, .compressed = true, .uncompressed_size = {fw["uncompressed_size"]} }},\n')
+            f.write(f'    {{ .name = "{fw["name"]}", {fw["desc"]} }},\n')
         f.write("};\n\n")
         
         # --- Viết biến fwNumber ---
         f.write("// Tự động tính toán tổng số firmware trong danh sách\n")
-        f.write(f"const int fwNumber = {len(fw_definitions)};\n")
+        f.write(f"const int fwNumber = {len(fw_definitions)};\n\n")
+
+        # --- Chỉ mục perfect hash theo tên file ---
+        fw_index = {fw["name"]: i for i, fw in enumerate(fw_definitions)}
+        seed, size, slots = build_perfect_hash(list(fw_index), fw_name_hash)
+        f.write("// Chỉ mục perfect hash: fwKeyHash(fwNameHash(tên)) -> vị trí trong fwList\n")
+        f.write("const int16_t fwNameIndex[] = {\n")
+        for slot in range(size):
+            f.write(f"    {fw_index[slots[slot]] if slot in slots else -1},\n")
+        f.write("};\n")
+        f.write(f"const uint32_t fwNameIndexSeed = {seed};\n")
+        f.write(f"const uint32_t fwNameIndexMask = {size - 1};\n\n")
+
+        # --- Patch đã tách, mỗi patch nén riêng ---
+        patch_descs = {}
+        for key, (name, lmp_subversion, rom_version, _, _, patch, config_size) in sorted(patch_entries.items(),
+                                                                                         key=lambda e: e[1][:3]):
+            var_name = f"{name.replace('.', '_')}_rom{rom_version}"
+            comment = f"Patch: {name}, chip 0x{lmp_subversion:04x}, ROM {rom_version}"
+            if config_size:
+                comment += f", {config_size} byte config"
+            patch_descs[key] = write_blob(f, var_name, comment, patch, stats) + ", .dict = NULL"
+
+        # --- Chỉ mục perfect hash theo (firmware, rom_version) ---
+        seed, size, slots = build_perfect_hash(list(patch_entries), fw_key_hash)
+        f.write("// Chỉ mục perfect hash: fwKeyHash(fwPatchKey(firmware, rom_version)) -> patch\n")
+        f.write("const struct FwPatchIndex fwPatchIndex[] = {\n")
+        for slot in range(size):
+            if slot not in slots:
+                f.write("    { },\n")
+                continue
+            key = slots[slot]
+            name, lmp_subversion, rom_version, project_id, fw_version, _, config_size = patch_entries[key]
+            f.write(f"    {{ .lmp_subversion = 0x{lmp_subversion:04x}, .rom_version = {rom_version}, "
+                    f".project_id = {project_id}, .fw_version = 0x{fw_version:08x}, .config_size = {config_size},\n"
+                    f'      .patch = {{ .name = "{name}", {patch_descs[key]} }} }},\n')
+        f.write("};\n")
+        f.write(f"const uint32_t fwPatchIndexSeed = {seed};\n")
+        f.write(f"const uint32_t fwPatchIndexMask = {size - 1};\n\n")
+
+        # --- Chỉ mục theo (fw_version, rom_version) cho controller đã có patch ---
+        # Chỉ patch v1 có fw_version; patch v2 không được đưa vào
+        patch_position = {key: slot for slot, key in slots.items()}
+        version_index = {}
+        for key, (name, _, rom_version, _, fw_version, _, _) in patch_entries.items():
+            if fw_version == 0:
+                continue
+            version_key = fw_patch_version_key(fw_version, rom_version)
+            if version_key in version_index:
+                raise RuntimeError(f"Patch {name} ROM {rom_version} trùng khóa phiên bản 0x{fw_version:08x}")
+            version_index[version_key] = patch_position[key]
+        seed, size, slots = build_perfect_hash(list(version_index), fw_key_hash)
+        f.write("// Chỉ mục perfect hash: fwKeyHash(fwPatchVersionKey(fw_version, rom_version)) -> vị trí trong fwPatchIndex\n")
+        f.write("const int16_t fwPatchVersionIndex[] = {\n")
+        for slot in range(size):
+            f.write(f"    {version_index[slots[slot]] if slot in slots else -1},\n")
+        f.write("};\n")
+        f.write(f"const uint32_t fwPatchVersionIndexSeed = {seed};\n")
+        f.write(f"const uint32_t fwPatchVersionIndexMask = {size - 1};\n\n")
+
+        # --- Cơ sở dữ liệu thiết bị ---
+        write_device_db(f, chips, patch_entries)
+        print(f"  - Chỉ mục: {len(fw_index)} firmware ({len(dictionaries)} nén theo từ điển), {len(patch_entries)} patch")
+
+    # --- Tổng kết theo codec ---
+    # Ước lượng theo DECODE_MBPS, không phải số đo trên máy build
+    for codec, (original, stored, decode_us) in sorted(stats.items()):
+        print(f"  - {codec}: {original} bytes -> {stored} bytes, giải nén ~{decode_us:.0f} us "
+              f"({DECODE_MBPS[codec]} MB/s)")
+    if lz4_block is None and FW_CODEC_LZ4 in stats:
+        print("  (cài module python lz4 để nén LZ4 tốt hơn)")
+
+    if not args.out_dir:
+        write_personalities(os.path.join(FIRMWARE_DEST_DIR, INFO_PLIST_FILE))
 
     print("\nHoàn tất! Đã tạo thành công FwData.cpp với firmware đã được nén.")
     print("Hãy thêm file FwData.cpp mới vào project Xcode của bạn và xóa file FwRtl.cpp cũ đi.")